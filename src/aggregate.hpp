@@ -0,0 +1,407 @@
+#pragma once
+#include "cpu.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#if ARENA_X86_SIMD
+#include <immintrin.h>
+#endif
+
+enum class Reduction
+{
+    Sum,
+    Min,
+    Max,
+    Count,
+    Mean
+};
+
+/// Reductions over a contiguous range of doubles
+/// min of an empty range is +inf, max is -inf
+/// Every min and max kernel skips NaNs like std::min(m, x) does with the
+/// running minimum as m, so a range of NaNs only is empty to them
+/// The vector kernels add in a different order than the scalar one, so sums
+/// may differ in the last bits
+/// The narrow sums widen float32 and fixed-point values as they go, floats
+/// are added as doubles and integers exactly in 64 bits
+struct ReduceKernels
+{
+    double (*sum)(double const*, size_t);
+    double (*min)(double const*, size_t);
+    double (*max)(double const*, size_t);
+    double (*sum_f32)(float const*, size_t);
+    double (*sum_i16)(int16_t const*, size_t);
+    double (*sum_i32)(int32_t const*, size_t);
+};
+
+namespace kernels
+{
+inline double sum_scalar(double const* p, size_t const n)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i)
+        sum += p[i];
+    return sum;
+}
+
+inline double min_scalar(double const* p, size_t const n)
+{
+    double m = std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < n; ++i)
+        m = std::min(m, p[i]);
+    return m;
+}
+
+inline double max_scalar(double const* p, size_t const n)
+{
+    double m = -std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < n; ++i)
+        m = std::max(m, p[i]);
+    return m;
+}
+
+inline double sum_f32_scalar(float const* p, size_t const n)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i)
+        sum += p[i];
+    return sum;
+}
+
+template <typename Int>
+double sum_int_scalar(Int const* p, size_t const n)
+{
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; ++i)
+        sum += p[i];
+    return double(sum);
+}
+
+#if ARENA_X86_SIMD
+ARENA_TARGET("avx2") inline double hsum256(__m256d v)
+{
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d const hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+ARENA_TARGET("avx2") inline double sum_avx2(double const* p, size_t const n)
+{
+    // four independent accumulators hide the latency of the adds
+    __m256d a0 = _mm256_setzero_pd();
+    __m256d a1 = _mm256_setzero_pd();
+    __m256d a2 = _mm256_setzero_pd();
+    __m256d a3 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        a0 = _mm256_add_pd(a0, _mm256_loadu_pd(p + i));
+        a1 = _mm256_add_pd(a1, _mm256_loadu_pd(p + i + 4));
+        a2 = _mm256_add_pd(a2, _mm256_loadu_pd(p + i + 8));
+        a3 = _mm256_add_pd(a3, _mm256_loadu_pd(p + i + 12));
+    }
+    for (; i + 4 <= n; i += 4)
+        a0 = _mm256_add_pd(a0, _mm256_loadu_pd(p + i));
+    double sum = hsum256(_mm256_add_pd(_mm256_add_pd(a0, a1), _mm256_add_pd(a2, a3)));
+    for (; i < n; ++i)
+        sum += p[i];
+    return sum;
+}
+
+ARENA_TARGET("avx2") inline double min_avx2(double const* p, size_t const n)
+{
+    __m256d a0 = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    __m256d a1 = a0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        // minpd returns its second operand if either is NaN, keep the minimum
+        a0 = _mm256_min_pd(_mm256_loadu_pd(p + i), a0);
+        a1 = _mm256_min_pd(_mm256_loadu_pd(p + i + 4), a1);
+    }
+    a0 = _mm256_min_pd(a0, a1);
+    alignas(32) double lanes[4];
+    _mm256_store_pd(lanes, a0);
+    double m = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+    for (; i < n; ++i)
+        m = std::min(m, p[i]);
+    return m;
+}
+
+ARENA_TARGET("avx2") inline double max_avx2(double const* p, size_t const n)
+{
+    __m256d a0 = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+    __m256d a1 = a0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        // maxpd returns its second operand if either is NaN, keep the maximum
+        a0 = _mm256_max_pd(_mm256_loadu_pd(p + i), a0);
+        a1 = _mm256_max_pd(_mm256_loadu_pd(p + i + 4), a1);
+    }
+    a0 = _mm256_max_pd(a0, a1);
+    alignas(32) double lanes[4];
+    _mm256_store_pd(lanes, a0);
+    double m = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    for (; i < n; ++i)
+        m = std::max(m, p[i]);
+    return m;
+}
+
+ARENA_TARGET("avx2") inline double sum_f32_avx2(float const* p, size_t const n)
+{
+    __m256d a0 = _mm256_setzero_pd();
+    __m256d a1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 const v = _mm256_loadu_ps(p + i);
+        a0 = _mm256_add_pd(a0, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+        a1 = _mm256_add_pd(a1, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+    }
+    double sum = hsum256(_mm256_add_pd(a0, a1));
+    for (; i < n; ++i)
+        sum += p[i];
+    return sum;
+}
+
+ARENA_TARGET("avx2") inline int64_t hsum256_epi64(__m256i v)
+{
+    alignas(32) int64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), v);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+ARENA_TARGET("avx2") inline double sum_i16_avx2(int16_t const* p, size_t const n)
+{
+    // madd adds neighbouring pairs into 32 bits, which are widened to 64
+    // before they can overflow
+    __m256i const ones = _mm256_set1_epi16(1);
+    __m256i a0 = _mm256_setzero_si256();
+    __m256i a1 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p + i));
+        __m256i const pairs = _mm256_madd_epi16(v, ones);
+        a0 = _mm256_add_epi64(a0, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(pairs)));
+        a1 = _mm256_add_epi64(a1, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(pairs, 1)));
+    }
+    int64_t sum = hsum256_epi64(_mm256_add_epi64(a0, a1));
+    for (; i < n; ++i)
+        sum += p[i];
+    return double(sum);
+}
+
+ARENA_TARGET("avx2") inline double sum_i32_avx2(int32_t const* p, size_t const n)
+{
+    __m256i a0 = _mm256_setzero_si256();
+    __m256i a1 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p + i));
+        a0 = _mm256_add_epi64(a0, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+        a1 = _mm256_add_epi64(a1, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+    }
+    int64_t sum = hsum256_epi64(_mm256_add_epi64(a0, a1));
+    for (; i < n; ++i)
+        sum += p[i];
+    return double(sum);
+}
+
+ARENA_TARGET("avx512f") inline double hsum512(__m512d v)
+{
+    alignas(64) double lanes[8];
+    _mm512_store_pd(lanes, v);
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+           ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+ARENA_TARGET("avx512f") inline double sum_avx512(double const* p, size_t const n)
+{
+    __m512d a0 = _mm512_setzero_pd();
+    __m512d a1 = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        a0 = _mm512_add_pd(a0, _mm512_loadu_pd(p + i));
+        a1 = _mm512_add_pd(a1, _mm512_loadu_pd(p + i + 8));
+    }
+    if (i + 8 <= n)
+    {
+        a0 = _mm512_add_pd(a0, _mm512_loadu_pd(p + i));
+        i += 8;
+    }
+    // the masked load does not touch memory past the end
+    __mmask8 const tail = __mmask8((1u << (n - i)) - 1);
+    a1 = _mm512_add_pd(a1, _mm512_maskz_loadu_pd(tail, p + i));
+    return hsum512(_mm512_add_pd(a0, a1));
+}
+
+ARENA_TARGET("avx512f") inline double min_avx512(double const* p, size_t const n)
+{
+    __m512d a = _mm512_set1_pd(std::numeric_limits<double>::infinity());
+    size_t i = 0;
+    // masked with all lanes set: minpd returns its second operand if either
+    // is NaN, which keeps the minimum, and unlike _mm512_min_pd it does not
+    // start from an undefined vector GCC warns about
+    __mmask8 const all = __mmask8(0xff);
+    for (; i + 8 <= n; i += 8)
+        a = _mm512_mask_min_pd(a, all, _mm512_loadu_pd(p + i), a);
+    __mmask8 const tail = __mmask8((1u << (n - i)) - 1);
+    a = _mm512_mask_min_pd(a, tail, _mm512_maskz_loadu_pd(tail, p + i), a);
+    alignas(64) double lanes[8];
+    _mm512_store_pd(lanes, a);
+    return *std::min_element(lanes, lanes + 8);
+}
+
+ARENA_TARGET("avx512f") inline double max_avx512(double const* p, size_t const n)
+{
+    __m512d a = _mm512_set1_pd(-std::numeric_limits<double>::infinity());
+    size_t i = 0;
+    // see min_avx512
+    __mmask8 const all = __mmask8(0xff);
+    for (; i + 8 <= n; i += 8)
+        a = _mm512_mask_max_pd(a, all, _mm512_loadu_pd(p + i), a);
+    __mmask8 const tail = __mmask8((1u << (n - i)) - 1);
+    a = _mm512_mask_max_pd(a, tail, _mm512_maskz_loadu_pd(tail, p + i), a);
+    alignas(64) double lanes[8];
+    _mm512_store_pd(lanes, a);
+    return *std::max_element(lanes, lanes + 8);
+}
+#endif
+} // namespace kernels
+
+/// Kernels for the given level, or for the best level the running CPU
+/// supports if that is lower
+inline ReduceKernels const& reduce_kernels(SimdLevel level)
+{
+    static ReduceKernels const scalar{&kernels::sum_scalar,
+                                      &kernels::min_scalar,
+                                      &kernels::max_scalar,
+                                      &kernels::sum_f32_scalar,
+                                      &kernels::sum_int_scalar<int16_t>,
+                                      &kernels::sum_int_scalar<int32_t>};
+#if ARENA_X86_SIMD
+    static ReduceKernels const avx2{&kernels::sum_avx2,
+                                    &kernels::min_avx2,
+                                    &kernels::max_avx2,
+                                    &kernels::sum_f32_avx2,
+                                    &kernels::sum_i16_avx2,
+                                    &kernels::sum_i32_avx2};
+    // the narrow sums are bound by memory already at AVX2
+    static ReduceKernels const avx512{&kernels::sum_avx512,
+                                      &kernels::min_avx512,
+                                      &kernels::max_avx512,
+                                      &kernels::sum_f32_avx2,
+                                      &kernels::sum_i16_avx2,
+                                      &kernels::sum_i32_avx2};
+
+    level = std::min(level, simd_level());
+    switch (level)
+    {
+    case SimdLevel::Avx512:
+        return avx512;
+    case SimdLevel::Avx2:
+        return avx2;
+    default:
+        break;
+    }
+#endif
+    return scalar;
+}
+
+/// Kernels for the running CPU
+inline ReduceKernels const& reduce_kernels()
+{
+    static ReduceKernels const& best = reduce_kernels(simd_level());
+    return best;
+}
+
+/// Reductions over values of any arithmetic type, as doubles
+/// Doubles go through the kernels, so do the sums of float32 and fixed-point
+/// values, other reductions through a scalar loop
+inline double reduce_sum(ReduceKernels const& k, double const* p, size_t const n)
+{
+    return k.sum(p, n);
+}
+
+inline double reduce_min(ReduceKernels const& k, double const* p, size_t const n)
+{
+    return k.min(p, n);
+}
+
+inline double reduce_max(ReduceKernels const& k, double const* p, size_t const n)
+{
+    return k.max(p, n);
+}
+
+inline double reduce_sum(ReduceKernels const& k, float const* p, size_t const n)
+{
+    return k.sum_f32(p, n);
+}
+
+inline double reduce_sum(ReduceKernels const& k, int16_t const* p, size_t const n)
+{
+    return k.sum_i16(p, n);
+}
+
+inline double reduce_sum(ReduceKernels const& k, int32_t const* p, size_t const n)
+{
+    return k.sum_i32(p, n);
+}
+
+template <typename T>
+double reduce_sum(ReduceKernels const&, T const* p, size_t const n)
+{
+    // independent accumulators, so the additions do not wait on each other
+    double acc[4] = {};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        for (size_t j = 0; j < 4; ++j)
+            acc[j] += double(p[i + j]);
+    }
+    for (; i < n; ++i)
+        acc[0] += double(p[i]);
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+/// Index of the first value of p that is not NaN, n if there is none
+template <typename T>
+size_t first_number(T const* p, size_t const n) noexcept
+{
+    size_t i = 0;
+    while (i < n && p[i] != p[i])
+        ++i;
+    return i;
+}
+
+template <typename T>
+double reduce_min(ReduceKernels const&, T const* p, size_t const n)
+{
+    // NaNs are skipped like the kernels do, the first number starts
+    size_t const first = first_number(p, n);
+    if (first == n)
+        return std::numeric_limits<double>::infinity();
+    T m = p[first];
+    for (size_t i = first + 1; i < n; ++i)
+        m = std::min(m, p[i]);
+    return double(m);
+}
+
+template <typename T>
+double reduce_max(ReduceKernels const&, T const* p, size_t const n)
+{
+    size_t const first = first_number(p, n);
+    if (first == n)
+        return -std::numeric_limits<double>::infinity();
+    T m = p[first];
+    for (size_t i = first + 1; i < n; ++i)
+        m = std::max(m, p[i]);
+    return double(m);
+}
@@ -1,8 +1,45 @@
 #pragma once
+#include "chunk_source.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <type_traits>
+
+// std::pmr::memory_resource is C++17, TypedArena is the allocator of older
+// standards
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define ARENA_HAS_PMR
+#endif
+#endif
 
 constexpr size_t DEFAULT_PAGE_SIZE = 4096;
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+/// How an ArenaAllocator sizes the chunks it adds when it runs out of space
+struct GrowthPolicy
+{
+    /// Each new chunk is this many times larger than the previous one
+    /// 1 keeps every chunk at the initial capacity
+    size_t factor = 2;
+    /// Chunks stop growing at this size
+    size_t max_chunk_size = size_t(64) << 20;
+    /// Try the space left in older chunks before adding a new one
+    /// Makes allocation O(number of chunks) when the current chunk is full
+    bool reuse_older_chunks = false;
+};
+
+/// What ArenaAllocator::rewind does with the chunks after the marked one
+enum class ChunkRetention
+{
+    // keep them for the next allocations, like clear()
+    Keep,
+    // give them back to the chunk source
+    Release
+};
 
 /// Allocator that frees all its memory on destruction
 class ArenaAllocator final
@@ -10,44 +47,87 @@ class ArenaAllocator final
     char* _start;
     char* _end;
     char* _next;
+    // chunks added later are taken from the source of the head
+    ChunkSource _source;
 
     // ArenaAllocator is a linked list
     ArenaAllocator* _next_arena = nullptr;
 
+    // The following are only used in the head of the list
+    // chunk new allocations are served from
+    ArenaAllocator* _current = this;
+    // chunks of single allocations too big for a regular chunk, newest first
+    // They stay out of the list above, so rewind never mistakes them for
+    // chunks that are free
+    ArenaAllocator* _oversized = nullptr;
+    size_t _next_chunk_size;
+    GrowthPolicy _policy;
+
 public:
     ArenaAllocator(ArenaAllocator const&) = delete;
     ArenaAllocator& operator=(ArenaAllocator const&) = delete;
 
-    explicit ArenaAllocator(size_t capacity = DEFAULT_PAGE_SIZE)
-        : _start(new char[capacity]), _end(_start + capacity), _next(_start)
+    explicit ArenaAllocator(size_t capacity = DEFAULT_PAGE_SIZE,
+                            GrowthPolicy policy = {},
+                            ChunkSource source = ChunkSource::Heap)
+        : _source(source)
+        , _next_chunk_size(capacity)
+        , _policy(policy)
     {
+        _start = chunk_source::map(capacity, _source);
+        _end = _start + capacity;
+        _next = _start;
+        grow_chunk_size();
     }
 
     ~ArenaAllocator()
     {
-        delete[] _start;
+        chunk_source::unmap(_start, _end - _start, _source);
         delete _next_arena;
+        delete _oversized;
     }
 
     ArenaAllocator(ArenaAllocator&& a) noexcept
-        : _start(a._start), _end(a._end), _next(a._next), _next_arena(a._next_arena)
+        : _start(a._start)
+        , _end(a._end)
+        , _next(a._next)
+        , _source(a._source)
+        , _next_arena(a._next_arena)
+        , _current(a._current == &a ? this : a._current)
+        , _oversized(a._oversized)
+        , _next_chunk_size(a._next_chunk_size)
+        , _policy(a._policy)
     {
         a._start = nullptr;
         a._end = nullptr;
         a._next = nullptr;
         a._next_arena = nullptr;
+        a._current = &a;
+        a._oversized = nullptr;
     }
 
     ArenaAllocator& operator=(ArenaAllocator&& a) noexcept
     {
+        if (this == &a)
+            return *this;
+        chunk_source::unmap(_start, _end - _start, _source);
+        delete _next_arena;
+        delete _oversized;
         _start = a._start;
         _end = a._end;
         _next = a._next;
+        _source = a._source;
         _next_arena = a._next_arena;
+        _current = a._current == &a ? this : a._current;
+        _oversized = a._oversized;
+        _next_chunk_size = a._next_chunk_size;
+        _policy = a._policy;
         a._start = nullptr;
         a._end = nullptr;
         a._next = nullptr;
         a._next_arena = nullptr;
+        a._current = &a;
+        a._oversized = nullptr;
         return *this;
     }
 
@@ -58,12 +138,46 @@ public:
         return _end - _next;
     }
 
+    /// Total bytes reserved by all chunks
+    size_t capacity() const noexcept
+    {
+        size_t total = 0;
+        for (ArenaAllocator const* a = this; a != nullptr; a = a->_next_arena)
+            total += a->_end - a->_start;
+        for (ArenaAllocator const* a = _oversized; a != nullptr; a = a->_next_arena)
+            total += a->_end - a->_start;
+        return total;
+    }
+
+    /// Where the chunks come from, after any fallback
+    ChunkSource source() const noexcept
+    {
+        return _source;
+    }
+
+    size_t chunk_count() const noexcept
+    {
+        size_t n = 0;
+        for (ArenaAllocator const* a = this; a != nullptr; a = a->_next_arena)
+            ++n;
+        for (ArenaAllocator const* a = _oversized; a != nullptr; a = a->_next_arena)
+            ++n;
+        return n;
+    }
+
     /// Allocate space for n items of type T
+    /// The result is aligned to alignment or alignof(T), whichever is larger,
+    /// alignment must be a power of two
+    /// Runs in constant time unless a new chunk is needed
     /// Throw std::bad_alloc if the Allocator is out of memory
     template <typename T>
-    T* allocate(const size_t n)
+    T* allocate(const size_t n, size_t alignment = alignof(T))
     {
-        return allocate_from<T>(this, n);
+        assert((alignment & (alignment - 1)) == 0);
+        alignment = std::max(alignment, alignof(T));
+        if (T* ptr = _current->bump<T>(n, alignment))
+            return ptr;
+        return allocate_slow<T>(n, alignment);
     }
 
     // Make the allocator usable in stl containers
@@ -72,15 +186,74 @@ public:
         // nope
     }
 
+    /// Position of the bump pointer, see mark()
+    struct Marker
+    {
+        ArenaAllocator* chunk;
+        char* next;
+        // newest oversized chunk
+        ArenaAllocator* oversized;
+    };
+
+    /// Remember the current position, rewind(marker) frees everything
+    /// allocated since
+    /// Markers are rewound in the reverse order they were taken in, moving or
+    /// clearing the arena invalidates them
+    Marker mark() noexcept
+    {
+        return Marker{_current, _current->_next, _oversized};
+    }
+
+    /// Free everything allocated since marker was taken
+    /// The regular chunks after the marked one, added since or left over from
+    /// before a clear(), are kept or released as retention says. Oversized
+    /// allocations made since are always released, no other allocation could
+    /// use their chunks. Space taken from older chunks by
+    /// GrowthPolicy::reuse_older_chunks is only freed by clear().
+    /// Using any pointer obtained after the marker is undefined behaviour
+    void rewind(Marker const marker, ChunkRetention const retention = ChunkRetention::Keep) noexcept
+    {
+        assert(owns_chunk(marker.chunk) && owns_oversized(marker.oversized));
+        while (_oversized != marker.oversized)
+        {
+            ArenaAllocator* const big = _oversized;
+            _oversized = big->_next_arena;
+            big->_next_arena = nullptr;
+            delete big;
+        }
+        ArenaAllocator* const chunk = marker.chunk;
+        if (retention == ChunkRetention::Release)
+        {
+            delete chunk->_next_arena;
+            chunk->_next_arena = nullptr;
+        }
+        else
+        {
+            for (ArenaAllocator* a = chunk->_next_arena; a != nullptr; a = a->_next_arena)
+                a->_next = a->_start;
+        }
+        chunk->_next = marker.next;
+        _current = chunk;
+    }
+
     /// Reset this allocator
     /// Note that this does not free any memory, but new items will override the
     /// old ones! Using any pointer obtained before clearing is undefined
     /// behaviour
+    /// Oversized chunks become regular ones that later allocations reuse
     void clear() noexcept
     {
-        _next = _start;
-        if (_next_arena)
-            _next_arena->clear();
+        ArenaAllocator* last = this;
+        for (ArenaAllocator* a = this; a != nullptr; a = a->_next_arena)
+        {
+            a->_next = a->_start;
+            last = a;
+        }
+        last->_next_arena = _oversized;
+        for (ArenaAllocator* a = _oversized; a != nullptr; a = a->_next_arena)
+            a->_next = a->_start;
+        _oversized = nullptr;
+        _current = this;
     }
 
     bool operator==(ArenaAllocator const& other) const noexcept
@@ -94,33 +267,124 @@ public:
     }
 
 private:
+    bool owns_chunk(ArenaAllocator const* const chunk) const noexcept
+    {
+        for (ArenaAllocator const* a = this; a != nullptr; a = a->_next_arena)
+        {
+            if (a == chunk)
+                return true;
+        }
+        return false;
+    }
+
+    bool owns_oversized(ArenaAllocator const* const chunk) const noexcept
+    {
+        for (ArenaAllocator const* a = _oversized; a != nullptr; a = a->_next_arena)
+        {
+            if (a == chunk)
+                return true;
+        }
+        return chunk == nullptr;
+    }
+
+    static char* align_up(char* const p, size_t const alignment) noexcept
+    {
+        uintptr_t const addr = uintptr_t(p);
+        return p + ((alignment - addr % alignment) % alignment);
+    }
+
+    /// Allocate from this chunk only, returns nullptr if it does not fit
     template <typename T>
-    T* allocate_from(ArenaAllocator* arena, const size_t n)
+    T* bump(const size_t n, const size_t alignment) noexcept
     {
-        assert(arena != nullptr);
         const size_t delta = sizeof(T) * n;
-        ArenaAllocator* last = nullptr;
-        do
+        char* const ptr = align_up(_next, alignment);
+        if (ptr <= _end && delta <= size_t(_end - ptr))
+        {
+            _next = ptr + delta;
+            return (T*)ptr;
+        }
+        return nullptr;
+    }
+
+    void grow_chunk_size() noexcept
+    {
+        _next_chunk_size = std::min(_next_chunk_size * _policy.factor, _policy.max_chunk_size);
+    }
+
+    template <typename T>
+    T* allocate_slow(const size_t n, const size_t alignment)
+    {
+        if (_policy.reuse_older_chunks)
         {
-            if (delta <= arena->remaining())
+            for (ArenaAllocator* a = this; a != _current; a = a->_next_arena)
             {
-                T* ptr = (T*)arena->_next;
-                arena->_next += delta;
-                return ptr;
+                if (T* ptr = a->bump<T>(n, alignment))
+                    return ptr;
             }
-            last = arena;
-            arena = arena->_next_arena;
-        } while (arena != nullptr);
-        const size_t capacity = std::max({size_t(_end - _start), delta});
-        last->_next_arena = new ArenaAllocator{capacity};
-        return allocate_from<T>(last->_next_arena, n);
+        }
+        // chunks after the current one are left over from before a clear()
+        while (_current->_next_arena != nullptr)
+        {
+            _current = _current->_next_arena;
+            if (T* ptr = _current->bump<T>(n, alignment))
+                return ptr;
+        }
+
+        const size_t delta = sizeof(T) * n + alignment;
+        if (delta > _next_chunk_size)
+        {
+            // too big for a regular chunk, give it a chunk of its own but keep
+            // allocating from the current one
+            ArenaAllocator* chunk = new ArenaAllocator{delta, GrowthPolicy{}, _source};
+            chunk->_next_arena = _oversized;
+            _oversized = chunk;
+            return chunk->bump<T>(n, alignment);
+        }
+        _current->_next_arena = new ArenaAllocator{_next_chunk_size, GrowthPolicy{}, _source};
+        _current = _current->_next_arena;
+        grow_chunk_size();
+        return _current->bump<T>(n, alignment);
+    }
+};
+
+/// Rewinds an arena to where it was when the scope was entered
+/// For scratch data of a single query or pass: everything allocated in the
+/// scope is freed at once when it ends.
+class ArenaScope final
+{
+    ArenaAllocator& _arena;
+    ArenaAllocator::Marker _marker;
+    ChunkRetention _retention;
+
+public:
+    explicit ArenaScope(ArenaAllocator& arena,
+                        ChunkRetention const retention = ChunkRetention::Keep) noexcept
+        : _arena(arena), _marker(arena.mark()), _retention(retention)
+    {
+    }
+
+    ArenaScope(ArenaScope const&) = delete;
+    ArenaScope& operator=(ArenaScope const&) = delete;
+
+    ~ArenaScope()
+    {
+        _arena.rewind(_marker, _retention);
+    }
+
+    ArenaAllocator& arena() const noexcept
+    {
+        return _arena;
     }
 };
 
 /// Typed Arena Allocator to be used in container templates
 /// Takes an ArenaAllocator as a backend
+/// Converts to the arena allocator of any other type, so node based
+/// containers can allocate their nodes from the same arena. Not final,
+/// containers may derive from their allocator.
 template <typename T>
-class TypedArena final
+class TypedArena
 {
     ArenaAllocator* _arena;
 
@@ -130,11 +394,29 @@ public:
     using void_pointer = void*;
     using const_void_pointer = void const*;
     using value_type = T;
+    using size_type = size_t;
+    using difference_type = ptrdiff_t;
+    // containers keep drawing from the arena of the one they were copied,
+    // moved or swapped from
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = TypedArena<U>;
+    };
 
     explicit TypedArena(ArenaAllocator& arena) : _arena(&arena)
     {
     }
 
+    template <typename U>
+    TypedArena(TypedArena<U> const& other) noexcept : _arena(&static_cast<ArenaAllocator&>(other))
+    {
+    }
+
     TypedArena() = delete;
 
     TypedArena(TypedArena<T> const&) = default;
@@ -152,17 +434,19 @@ public:
     }
 
     // Make the allocator usable in stl containers
-    void deallocate(void* _p, size_t _n) noexcept
+    void deallocate(T* _p, size_t _n) noexcept
     {
         // nope
     }
 
-    bool operator==(TypedArena<T> const& other) const noexcept
+    template <typename U>
+    bool operator==(TypedArena<U> const& other) const noexcept
     {
-        return _arena == other._arena;
+        return _arena == &static_cast<ArenaAllocator&>(other);
     }
 
-    bool operator!=(TypedArena<T> const& other) const noexcept
+    template <typename U>
+    bool operator!=(TypedArena<U> const& other) const noexcept
     {
         return !(*this == other);
     }
@@ -173,3 +457,39 @@ public:
     }
 };
 
+#ifdef ARENA_HAS_PMR
+/// ArenaAllocator as a std::pmr::memory_resource, for
+/// std::pmr::polymorphic_allocator and the std::pmr containers
+/// Deallocation is a no-op like everywhere else in the arena
+/// !!Important!! this object does not manage memory.
+class ArenaResource final : public std::pmr::memory_resource
+{
+    ArenaAllocator* _arena;
+
+public:
+    explicit ArenaResource(ArenaAllocator& arena) noexcept : _arena(&arena)
+    {
+    }
+
+    ArenaAllocator& arena() const noexcept
+    {
+        return *_arena;
+    }
+
+private:
+    void* do_allocate(size_t const bytes, size_t const alignment) override
+    {
+        return _arena->allocate<char>(bytes, alignment);
+    }
+
+    void do_deallocate(void*, size_t, size_t) override
+    {
+    }
+
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        auto const* const resource = dynamic_cast<ArenaResource const*>(&other);
+        return resource != nullptr && resource->_arena == _arena;
+    }
+};
+#endif
@@ -0,0 +1,159 @@
+#pragma once
+#include "arena.hpp"
+#include "key_traits.hpp"
+#include "point.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+/// Counters of a BlockedBloomFilter
+struct BloomStats
+{
+    // keys checked
+    uint64_t queries = 0;
+    // keys the filter rejected, all of them were absent
+    uint64_t negatives = 0;
+    // keys the filter let through that turned out to be absent
+    uint64_t false_positives = 0;
+
+    /// Share of the absent keys the filter let through
+    double false_positive_rate() const noexcept
+    {
+        uint64_t const absent = negatives + false_positives;
+        return absent == 0 ? 0.0 : double(false_positives) / double(absent);
+    }
+};
+
+/// Bloom filter whose blocks are one cache line each
+/// All bits of a key are set in the same 512 bit block, so a check costs a
+/// single cache miss. Slightly more false positives than a classic filter of
+/// the same size is the price.
+/// !!Important!! this object does not manage memory.
+/// Blocks are taken from the ArenaAllocator passed to reserve.
+class BlockedBloomFilter final
+{
+    static constexpr size_t BLOCK_BITS = 512;
+    static constexpr size_t BLOCK_WORDS = BLOCK_BITS / 64;
+
+    uint64_t* words = nullptr;
+    size_t block_count = 0;
+    size_t max_count = 0;
+    double key_bits = 0.0;
+    unsigned hashes = 0;
+    mutable BloomStats stats;
+
+public:
+    bool enabled() const noexcept
+    {
+        return words != nullptr;
+    }
+
+    /// Keys the filter was sized for, the false positive rate goes up when
+    /// more are inserted
+    size_t capacity() const noexcept
+    {
+        return max_count;
+    }
+
+    /// Allocate an empty filter for n keys at bits bits per key
+    /// Keys inserted before are forgotten
+    void reserve(ArenaAllocator& allocator, size_t const n, double const bits)
+    {
+        key_bits = std::max(bits, 1.0);
+        // k = ln 2 * m / n minimizes the false positive rate
+        hashes = unsigned(std::min(std::max(std::lround(key_bits * 0.693), 1L), 16L));
+        max_count = std::max(n, size_t(1));
+        double const total_bits = double(max_count) * key_bits;
+        block_count = std::max(size_t(std::ceil(total_bits / BLOCK_BITS)), size_t(1));
+        words = allocator.allocate<uint64_t>(block_count * BLOCK_WORDS, CACHE_LINE_SIZE);
+        std::fill(words, words + block_count * BLOCK_WORDS, 0);
+    }
+
+    double bits_per_key() const noexcept
+    {
+        return key_bits;
+    }
+
+    template <typename Key>
+    void insert(Key const key) noexcept
+    {
+        uint64_t const h = mix(key);
+        uint64_t* const block = block_of(h);
+        for (unsigned i = 0; i < hashes; ++i)
+        {
+            uint32_t const bit = bit_of(h, i);
+            block[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+    }
+
+    /// false if key was never inserted, true if it might have been
+    template <typename Key>
+    bool may_contain(Key const key) const noexcept
+    {
+        ++stats.queries;
+        uint64_t const h = mix(key);
+        uint64_t const* const block = block_of(h);
+        for (unsigned i = 0; i < hashes; ++i)
+        {
+            uint32_t const bit = bit_of(h, i);
+            if ((block[bit / 64] & (uint64_t(1) << (bit % 64))) == 0)
+            {
+                ++stats.negatives;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Record that a key may_contain let through was absent
+    void note_false_positive() const noexcept
+    {
+        ++stats.false_positives;
+    }
+
+    BloomStats const& statistics() const noexcept
+    {
+        return stats;
+    }
+
+    void reset_statistics() noexcept
+    {
+        stats = BloomStats{};
+    }
+
+    /// Forget all keys but keep the blocks
+    void clear() noexcept
+    {
+        if (enabled())
+            std::fill(words, words + block_count * BLOCK_WORDS, 0);
+    }
+
+private:
+    template <typename Key>
+    static uint64_t mix(Key const key) noexcept
+    {
+        // the key hash is also used by the hash index and the shards, one more
+        // multiply keeps the filter independent of them
+        return KeyTraits<Key>::hash(key) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    /// Bit i of a key in its block
+    /// The low half of the hash times an odd salt per bit, the top 9 bits of
+    /// the product pick the bit (as in Parquet's split block filter)
+    static uint32_t bit_of(uint64_t const h, unsigned const i) noexcept
+    {
+        static constexpr uint32_t salts[16] = {
+            0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du, 0x705495c7u, 0x2df1424bu,
+            0x9efc4947u, 0x5c6bfb31u, 0x9e3779b1u, 0x85ebca6bu, 0xc2b2ae35u, 0x27d4eb2fu,
+            0x165667b1u, 0xd3a2646du, 0xfd7046c5u, 0xb55a4f09u};
+        return (uint32_t(h) * salts[i]) >> 23;
+    }
+
+    uint64_t* block_of(uint64_t const h) const noexcept
+    {
+        // maps the high half of the hash onto [0, block_count) without a
+        // division
+        size_t const block = size_t((h >> 32) * uint64_t(block_count) >> 32);
+        return words + block * BLOCK_WORDS;
+    }
+};
@@ -0,0 +1,537 @@
+#pragma once
+#include "chunk_source.hpp"
+#include "db.hpp"
+#include "parallel.hpp"
+#include "point.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if ARENA_HAS_MMAP
+#include <unistd.h>
+#endif
+
+/// Layout of the records read by bulk_load
+enum class RecordFormat
+{
+    // text lines x,y,v0,v1,... with x and y integers, blank lines are skipped
+    Csv,
+    // int32 x, int32 y, uint32 value count, then that many doubles, all in
+    // the byte order of the machine and without padding
+    Binary
+};
+
+struct BulkLoadOptions
+{
+    RecordFormat format = RecordFormat::Csv;
+    /// Threads parsing the input, including the calling one
+    /// 0 uses all hardware threads
+    unsigned threads = 0;
+    /// Bytes of input parsed by one task, every chunk becomes a sorted run
+    size_t chunk_size = size_t(4) << 20;
+    /// Bytes read from a stream at a time, the next block is read while the
+    /// previous one is parsed
+    size_t block_size = size_t(64) << 20;
+};
+
+namespace bulk
+{
+constexpr size_t BINARY_HEADER_SIZE = 2 * sizeof(int32_t) + sizeof(uint32_t);
+
+inline bool is_digit(char const c) noexcept
+{
+    return unsigned(c - '0') < 10;
+}
+
+/// Parse a decimal int at p, advances p past it
+inline bool parse_int(char const*& p, char const* const end, int& out) noexcept
+{
+    bool const negative = p != end && *p == '-';
+    if (p != end && (*p == '-' || *p == '+'))
+        ++p;
+    if (p == end || !is_digit(*p))
+        return false;
+    int64_t v = 0;
+    for (; p != end && is_digit(*p); ++p)
+    {
+        v = 10 * v + (*p - '0');
+        if (v > int64_t(std::numeric_limits<int>::max()) + 1)
+            return false;
+    }
+    v = negative ? -v : v;
+    if (v > std::numeric_limits<int>::max())
+        return false;
+    out = int(v);
+    return true;
+}
+
+/// Parse a decimal floating point number at p, advances p past it
+/// Numbers of up to 19 significant digits and a small exponent are converted
+/// exactly without strtod, the rest go through strtod
+inline bool parse_double(char const*& p, char const* const end, double& out)
+{
+    // 10^22 is the largest power of ten a double holds exactly
+    static constexpr double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                        1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                        1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    char const* const start = p;
+    bool const negative = p != end && *p == '-';
+    if (p != end && (*p == '-' || *p == '+'))
+        ++p;
+    uint64_t mantissa = 0;
+    int significant = 0;
+    int exponent = 0;
+    bool digits = false;
+    bool truncated = false;
+    for (; p != end && is_digit(*p); ++p)
+    {
+        digits = true;
+        if (significant < 19)
+        {
+            mantissa = 10 * mantissa + uint64_t(*p - '0');
+            significant += mantissa != 0;
+        }
+        else
+        {
+            truncated = true;
+            ++exponent;
+        }
+    }
+    if (p != end && *p == '.')
+    {
+        for (++p; p != end && is_digit(*p); ++p)
+        {
+            digits = true;
+            if (significant < 19)
+            {
+                mantissa = 10 * mantissa + uint64_t(*p - '0');
+                significant += mantissa != 0;
+                --exponent;
+            }
+            else
+            {
+                truncated = true;
+            }
+        }
+    }
+    if (!digits)
+        return false;
+    if (p != end && (*p == 'e' || *p == 'E'))
+    {
+        ++p;
+        bool const negative_exponent = p != end && *p == '-';
+        if (p != end && (*p == '-' || *p == '+'))
+            ++p;
+        if (p == end || !is_digit(*p))
+            return false;
+        int e = 0;
+        for (; p != end && is_digit(*p); ++p)
+            e = std::min(10 * e + (*p - '0'), 100000);
+        exponent += negative_exponent ? -e : e;
+    }
+    if (!truncated && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22)
+    {
+        // both operands are exact, so the result is correctly rounded
+        double const m = double(mantissa);
+        double const v = exponent < 0 ? m / powers[-exponent] : m * powers[exponent];
+        out = negative ? -v : v;
+        return true;
+    }
+    std::string const text{start, p};
+    char* parsed = nullptr;
+    out = std::strtod(text.c_str(), &parsed);
+    return parsed == text.c_str() + text.size();
+}
+
+/// End of the line starting at p, the position of its '\n' or end
+inline char const* line_end(char const* const p, char const* const end) noexcept
+{
+    auto const* const nl = static_cast<char const*>(std::memchr(p, '\n', end - p));
+    return nl == nullptr ? end : nl;
+}
+
+/// Start of the line after the one ending at e
+inline char const* next_line(char const* const e, char const* const end) noexcept
+{
+    return e == end ? end : e + 1;
+}
+
+/// Whether [p, e) holds nothing but a '\r'
+inline bool is_blank(char const* const p, char const* const e) noexcept
+{
+    return p == e || (e - p == 1 && *p == '\r');
+}
+
+/// Length of the binary record at p, 0 if it does not end before end
+inline size_t binary_record_size(char const* const p, char const* const end) noexcept
+{
+    if (size_t(end - p) < BINARY_HEADER_SIZE)
+        return 0;
+    uint32_t count;
+    std::memcpy(&count, p + 2 * sizeof(int32_t), sizeof(count));
+    size_t const bytes = BINARY_HEADER_SIZE + size_t(count) * sizeof(double);
+    return bytes <= size_t(end - p) ? bytes : 0;
+}
+} // namespace bulk
+
+/// Loads blocks of records into an ArenaDb
+/// Every block is split into chunks on record boundaries. Worker threads count
+/// the records of their chunks, the rows of the whole block are appended at
+/// once, then the workers parse their chunks straight into the keys and the
+/// value slab and sort them. finish() merges the sorted runs of all blocks.
+/// A block that fails to parse is rolled back, the blocks before it stay in
+/// the database unsorted.
+class BulkLoader final
+{
+    struct Chunk
+    {
+        char const* begin;
+        char const* end;
+        // position of the first key of the chunk
+        size_t first;
+        size_t count;
+    };
+
+    ArenaDb& db;
+    BulkLoadOptions options;
+    unsigned threads;
+    std::vector<Chunk> chunks;
+    std::vector<size_t> run_starts;
+    size_t loaded = 0;
+
+public:
+    explicit BulkLoader(ArenaDb& db, BulkLoadOptions const& options)
+        : db(db)
+        , options(options)
+        , threads(options.threads != 0 ? options.threads : parallel::hardware_threads())
+    {
+        this->options.chunk_size = std::max(this->options.chunk_size, size_t(1));
+        // runs are merged with the prefix, an unsorted tail would break them
+        db.sort();
+    }
+
+    /// Records loaded so far
+    size_t size() const noexcept
+    {
+        return loaded;
+    }
+
+    /// Length of the complete records at the start of [data, data + n)
+    size_t complete_prefix(char const* const data, size_t const n) const noexcept
+    {
+        if (options.format == RecordFormat::Csv)
+        {
+            size_t i = n;
+            while (i != 0 && data[i - 1] != '\n')
+                --i;
+            return i;
+        }
+        size_t i = 0;
+        for (size_t r; (r = bulk::binary_record_size(data + i, data + n)) != 0;)
+            i += r;
+        return i;
+    }
+
+    /// Load n bytes of complete records
+    /// offset is the position of data in the whole input, for error messages
+    /// Throw std::runtime_error if a record is malformed or has more values
+    /// than the rows of the database hold
+    void load_block(char const* const data, size_t const n, uint64_t const offset)
+    {
+        split(data, n, offset);
+        if (options.format == RecordFormat::Csv)
+            parallel([this](Chunk& c) { c.count = count_lines(c); });
+
+        size_t total = 0;
+        for (auto& c : chunks)
+        {
+            c.first = total;
+            total += c.count;
+        }
+        size_t const row_count = db.values.size();
+        size_t const first = db.append_rows(total);
+        try
+        {
+            parallel([&](Chunk& c) {
+                c.first += first;
+                if (options.format == RecordFormat::Csv)
+                    parse_csv(c, data, offset);
+                else
+                    parse_binary(c, data, offset);
+                db.sort_range(c.first, c.first + c.count);
+            });
+        }
+        catch (...)
+        {
+            db.truncate(first, row_count);
+            throw;
+        }
+        db.index_appended(first);
+        for (auto const& c : chunks)
+            if (c.count != 0)
+                run_starts.push_back(c.first);
+        loaded += total;
+    }
+
+    /// Merge the runs of all blocks, the database comes out sorted
+    void finish()
+    {
+        db.merge_runs(run_starts, threads);
+        run_starts.clear();
+    }
+
+private:
+    void split(char const* const data, size_t const n, uint64_t const offset)
+    {
+        chunks.clear();
+        char const* const end = data + n;
+        char const* p = data;
+        while (p != end)
+        {
+            char const* cut = p + std::min(options.chunk_size, size_t(end - p));
+            size_t count = 0;
+            if (options.format == RecordFormat::Csv)
+            {
+                cut = bulk::next_line(bulk::line_end(cut, end), end);
+            }
+            else
+            {
+                // binary records can only be found by walking them
+                char const* q = p;
+                while (q < cut)
+                {
+                    size_t const r = bulk::binary_record_size(q, end);
+                    if (r == 0)
+                        fail("truncated record", offset + uint64_t(q - data));
+                    q += r;
+                    ++count;
+                }
+                cut = q;
+            }
+            chunks.push_back(Chunk{p, cut, 0, count});
+            p = cut;
+        }
+    }
+
+    static size_t count_lines(Chunk const& c) noexcept
+    {
+        size_t count = 0;
+        for (char const* p = c.begin; p < c.end;)
+        {
+            char const* const e = bulk::line_end(p, c.end);
+            count += !bulk::is_blank(p, e);
+            p = bulk::next_line(e, c.end);
+        }
+        return count;
+    }
+
+    void parse_csv(Chunk const& c, char const* const data, uint64_t const offset)
+    {
+        size_t pos = c.first;
+        for (char const* p = c.begin; p < c.end;)
+        {
+            char const* e = bulk::line_end(p, c.end);
+            char const* const next = bulk::next_line(e, c.end);
+            if (e != p && e[-1] == '\r')
+                --e;
+            if (p == e)
+            {
+                p = next;
+                continue;
+            }
+            char const* const line = p;
+            Point key;
+            if (!bulk::parse_int(p, e, key.x) || p == e || *p++ != ',' ||
+                !bulk::parse_int(p, e, key.y))
+                fail("malformed key", offset + uint64_t(line - data));
+            ArenaDb::VecValues& values = db.values.at(db.rows.at(pos));
+            double* const out = values.begin();
+            size_t k = 0;
+            while (p != e)
+            {
+                if (*p++ != ',' || k == db.value_capacity || !bulk::parse_double(p, e, out[k]))
+                    fail(k == db.value_capacity ? "too many values" : "malformed value",
+                         offset + uint64_t(line - data));
+                ++k;
+            }
+            values.resize(k);
+            db.keys.at(pos) = key;
+            ++pos;
+            p = next;
+        }
+    }
+
+    void parse_binary(Chunk const& c, char const* const data, uint64_t const offset)
+    {
+        char const* p = c.begin;
+        for (size_t pos = c.first; pos < c.first + c.count; ++pos)
+        {
+            Point key;
+            uint32_t count;
+            std::memcpy(&key.x, p, sizeof(int32_t));
+            std::memcpy(&key.y, p + sizeof(int32_t), sizeof(int32_t));
+            std::memcpy(&count, p + 2 * sizeof(int32_t), sizeof(count));
+            if (count > db.value_capacity)
+                fail("too many values", offset + uint64_t(p - data));
+            ArenaDb::VecValues& values = db.values.at(db.rows.at(pos));
+            std::memcpy(values.begin(), p + bulk::BINARY_HEADER_SIZE, count * sizeof(double));
+            values.resize(count);
+            db.keys.at(pos) = key;
+            p += bulk::BINARY_HEADER_SIZE + count * sizeof(double);
+        }
+    }
+
+    [[noreturn]] static void fail(char const* const what, uint64_t const offset)
+    {
+        throw std::runtime_error(std::string{"bulk_load: "} + what + " at byte " +
+                                 std::to_string(offset));
+    }
+
+    /// Call f(Chunk&) for every chunk on the worker threads
+    /// The first exception thrown by f is rethrown once all workers stopped
+    template <typename F>
+    void parallel(F const& f)
+    {
+        std::exception_ptr error;
+        std::atomic<bool> failed{false};
+        parallel::for_each_index(chunks.size(), threads, [&](size_t const i) {
+            if (failed)
+                return;
+            try
+            {
+                f(chunks[i]);
+            }
+            catch (...)
+            {
+                if (!failed.exchange(true))
+                    error = std::current_exception();
+            }
+        });
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+/// Insert the records in [data, data + n) and sort the database
+/// Keys must not be present yet and every record must be unique
+/// Returns the number of records loaded
+/// Throw std::runtime_error if a record is malformed
+inline size_t bulk_load(ArenaDb& db,
+                        char const* const data,
+                        size_t const n,
+                        BulkLoadOptions const& options = {})
+{
+    BulkLoader loader{db, options};
+    loader.load_block(data, n, 0);
+    loader.finish();
+    return loader.size();
+}
+
+/// Insert the records read by read(char* buffer, size_t n) and sort the
+/// database
+/// read returns the number of bytes it wrote to buffer, 0 at the end of the
+/// input. The next block is read while the previous one is parsed.
+/// Returns the number of records loaded
+/// Throw std::runtime_error if a record is malformed, exceptions of read are
+/// passed on
+template <typename Read>
+size_t bulk_load_stream(ArenaDb& db, Read&& read, BulkLoadOptions const& options = {})
+{
+    BulkLoader loader{db, options};
+    size_t const block = std::max(options.block_size, size_t(1));
+    bool eof = false;
+    // read until buffer is full or the input ends, returns the bytes in buffer
+    auto fill = [&](std::vector<char>& buffer, size_t filled) -> size_t {
+        while (filled < buffer.size() && !eof)
+        {
+            size_t const got = read(buffer.data() + filled, buffer.size() - filled);
+            eof = got == 0;
+            filled += got;
+        }
+        return filled;
+    };
+
+    std::vector<char> buffers[2] = {std::vector<char>(block), std::vector<char>(block)};
+    size_t cur = 0;
+    size_t filled = fill(buffers[0], 0);
+    uint64_t offset = 0;
+    for (;;)
+    {
+        char const* const data = buffers[cur].data();
+        size_t const complete = eof ? filled : loader.complete_prefix(data, filled);
+        if (complete == 0 && !eof)
+        {
+            // a record longer than the buffer
+            buffers[cur].resize(2 * buffers[cur].size());
+            filled = fill(buffers[cur], filled);
+            continue;
+        }
+
+        std::exception_ptr error;
+        std::thread parser{[&] {
+            try
+            {
+                loader.load_block(data, complete, offset);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+        }};
+        size_t const next = 1 - cur;
+        size_t const carry = filled - complete;
+        size_t next_filled = 0;
+        try
+        {
+            if (buffers[next].size() < carry + block)
+                buffers[next].resize(carry + block);
+            std::copy(data + complete, data + filled, buffers[next].data());
+            next_filled = fill(buffers[next], carry);
+        }
+        catch (...)
+        {
+            parser.join();
+            throw;
+        }
+        parser.join();
+        if (error)
+            std::rethrow_exception(error);
+        offset += complete;
+        if (complete == filled && next_filled == 0)
+            break;
+        cur = next;
+        filled = next_filled;
+    }
+    loader.finish();
+    return loader.size();
+}
+
+#if ARENA_HAS_MMAP
+/// bulk_load_stream from a file descriptor, read until the end of the file
+/// Throw std::runtime_error if reading fails
+inline size_t bulk_load(ArenaDb& db, int const fd, BulkLoadOptions const& options = {})
+{
+    return bulk_load_stream(
+        db,
+        [fd](char* const buffer, size_t const n) -> size_t {
+            for (;;)
+            {
+                ssize_t const got = ::read(fd, buffer, n);
+                if (got >= 0)
+                    return size_t(got);
+                if (errno != EINTR)
+                    throw std::runtime_error("bulk_load: read failed");
+            }
+        },
+        options);
+}
+#endif
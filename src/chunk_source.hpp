@@ -0,0 +1,111 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define ARENA_HAS_MMAP 1
+#else
+#define ARENA_HAS_MMAP 0
+#endif
+
+constexpr size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+/// Where an ArenaAllocator gets the memory for its chunks
+/// Sources that are not available on the platform fall back to the next
+/// simpler one, down to Heap
+enum class ChunkSource
+{
+    // new char[]
+    Heap,
+    // anonymous mmap, pages are faulted in on first touch
+    Mmap,
+    // anonymous mmap with MAP_POPULATE, pages are faulted in up front
+    MmapPopulate,
+    // 2 MB aligned mmap with madvise(MADV_HUGEPAGE)
+    TransparentHugePages,
+    // MAP_HUGETLB, needs huge pages reserved by the system
+    // Falls back to TransparentHugePages when none are available
+    HugePages,
+};
+
+namespace chunk_source
+{
+inline size_t round_up(size_t const n, size_t const to) noexcept
+{
+    return (n + to - 1) / to * to;
+}
+
+/// Map a chunk of at least capacity bytes
+/// capacity is rounded up to what was actually mapped and source is set to
+/// the source that provided it
+/// Throw std::bad_alloc if no memory could be mapped
+inline char* map(size_t& capacity, ChunkSource& source)
+{
+#if ARENA_HAS_MMAP
+    if (source != ChunkSource::Heap)
+    {
+        int const prot = PROT_READ | PROT_WRITE;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+        if (source == ChunkSource::HugePages)
+        {
+            size_t const size = round_up(capacity, HUGE_PAGE_SIZE);
+            void* const p = mmap(nullptr, size, prot, flags | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED)
+            {
+                capacity = size;
+                return (char*)p;
+            }
+        }
+#endif
+        if (source == ChunkSource::HugePages || source == ChunkSource::TransparentHugePages)
+        {
+            source = ChunkSource::TransparentHugePages;
+            size_t const size = round_up(capacity, HUGE_PAGE_SIZE);
+            // over-map, then trim both ends so the chunk is huge page aligned
+            char* const p = (char*)mmap(nullptr, size + HUGE_PAGE_SIZE, prot, flags, -1, 0);
+            if (p == (char*)MAP_FAILED)
+                throw std::bad_alloc{};
+            char* const aligned = (char*)round_up(uintptr_t(p), HUGE_PAGE_SIZE);
+            if (aligned != p)
+                munmap(p, aligned - p);
+            munmap(aligned + size, (p + HUGE_PAGE_SIZE) - aligned);
+#ifdef MADV_HUGEPAGE
+            madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+            capacity = size;
+            return aligned;
+        }
+#ifdef MAP_POPULATE
+        if (source == ChunkSource::MmapPopulate)
+            flags |= MAP_POPULATE;
+#endif
+        size_t const size = round_up(capacity, 4096);
+        void* const p = mmap(nullptr, size, prot, flags, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc{};
+        capacity = size;
+        return (char*)p;
+    }
+#endif
+    source = ChunkSource::Heap;
+    return new char[capacity];
+}
+
+/// Release a chunk obtained from map
+inline void unmap(char* const chunk, size_t const capacity, ChunkSource const source) noexcept
+{
+    if (chunk == nullptr)
+        return;
+#if ARENA_HAS_MMAP
+    if (source != ChunkSource::Heap)
+    {
+        munmap(chunk, capacity);
+        return;
+    }
+#endif
+    delete[] chunk;
+}
+} // namespace chunk_source
@@ -0,0 +1,433 @@
+#pragma once
+#include "arena.hpp"
+#include "cpu.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#if ARENA_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/// Fixed-point value of a database with value_scale() scale
+/// Rounds to the nearest step and saturates to the range of Int
+template <typename Int>
+Int to_fixed(double const value, double const scale) noexcept
+{
+    static_assert(std::is_integral<Int>::value, "fixed-point values are integers");
+    double const steps = std::nearbyint(value / scale);
+    double const lo = double(std::numeric_limits<Int>::min());
+    double const hi = double(std::numeric_limits<Int>::max());
+    return Int(std::min(std::max(steps, lo), hi));
+}
+
+template <typename Int>
+double from_fixed(Int const value, double const scale) noexcept
+{
+    return double(value) * scale;
+}
+
+namespace delta
+{
+inline uint64_t zigzag(int64_t const v) noexcept
+{
+    return (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t const v) noexcept
+{
+    return int64_t(v >> 1) ^ -int64_t(v & 1);
+}
+
+/// Number of bits of the largest of n codes
+inline unsigned bit_width(uint64_t const* codes, size_t const n) noexcept
+{
+    uint64_t all = 0;
+    for (size_t i = 0; i < n; ++i)
+        all |= codes[i];
+    unsigned bits = 0;
+    while (all >> bits != 0)
+        ++bits;
+    return bits;
+}
+
+/// Unpack n bits wide codes of a packed stream to out
+/// The stream is padded with a word, so reading past a word boundary needs
+/// no branch. Codes of 0 bits take no words and are not read at all, their
+/// start may be the padding word itself.
+inline void unpack(uint64_t const* words, unsigned const bits, size_t const n, uint64_t* out)
+{
+    if (bits == 0)
+    {
+        std::fill(out, out + n, uint64_t(0));
+        return;
+    }
+    uint64_t const mask = bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+    size_t at = 0;
+    for (size_t i = 0; i < n; ++i, at += bits)
+    {
+        unsigned const shift = unsigned(at & 63);
+        uint64_t const lo = words[at >> 6] >> shift;
+        // two shifts, so a shift of 0 does not shift by 64
+        uint64_t const hi = (words[(at >> 6) + 1] << 1) << (63 - shift);
+        out[i] = (lo | hi) & mask;
+    }
+}
+
+/// Differences per group, a group of b bits wide codes fills b words
+constexpr unsigned GROUP = 64;
+/// Widest code, the zigzag coded difference of two 32 bit integers
+constexpr unsigned MAX_BITS = 33;
+
+/// Add GROUP Bits wide differences to v and every new v to sum
+/// Unrolled, so every shift is a constant
+template <unsigned Bits>
+void add_group(uint64_t const* words, int64_t& v, int64_t& sum) noexcept
+{
+    // locals, the references may alias the words
+    int64_t value = v;
+    int64_t total = sum;
+    ARENA_UNROLL
+    for (unsigned i = 0; i < GROUP; ++i)
+    {
+        unsigned const at = i * Bits;
+        unsigned const shift = at % 64;
+        uint64_t x = words[at / 64] >> shift;
+        if (shift + Bits > 64)
+            x |= words[at / 64 + 1] << ((64 - shift) % 64);
+        value += unzigzag(x & ((uint64_t(1) << Bits) - 1));
+        total += value;
+    }
+    v = value;
+    sum = total;
+}
+
+#if ARENA_X86_SIMD
+/// add_group four differences at a time
+/// A code is read from the 8 bytes starting at its first byte, which holds
+/// all of it as codes are at most 33 bits wide. The last ones read up to 7
+/// bytes past the group, which the words of the next group or the padding
+/// word cover. Every lane keeps its own running value, the sum of the running
+/// values of all lanes is rebuilt from them at the end.
+template <unsigned Bits>
+ARENA_TARGET("avx2") void add_group_avx2(uint64_t const* words, int64_t& v, int64_t& sum) noexcept
+{
+    static_assert(Bits <= 57, "a code must fit in 8 bytes from its first byte");
+    unsigned char const* const bytes = reinterpret_cast<unsigned char const*>(words);
+    __m256i const mask = _mm256_set1_epi64x(int64_t((uint64_t(1) << Bits) - 1));
+    __m256i const one = _mm256_set1_epi64x(1);
+    __m256i const zero = _mm256_setzero_si256();
+    __m256i run = zero;
+    __m256i total = zero;
+    ARENA_UNROLL
+    for (unsigned i = 0; i < GROUP; i += 4)
+    {
+        uint64_t w[4];
+        for (unsigned k = 0; k < 4; ++k)
+            std::memcpy(&w[k], bytes + (i + k) * Bits / 8, sizeof(uint64_t));
+        __m256i x = _mm256_set_epi64x(int64_t(w[3]), int64_t(w[2]), int64_t(w[1]), int64_t(w[0]));
+        __m256i const shift = _mm256_set_epi64x(
+            (i + 3) * Bits % 8, (i + 2) * Bits % 8, (i + 1) * Bits % 8, i * Bits % 8);
+        x = _mm256_and_si256(_mm256_srlv_epi64(x, shift), mask);
+        // unzigzag
+        __m256i const d = _mm256_xor_si256(_mm256_srli_epi64(x, 1),
+                                           _mm256_sub_epi64(zero, _mm256_and_si256(x, one)));
+        run = _mm256_add_epi64(run, d);
+        total = _mm256_add_epi64(total, run);
+    }
+    alignas(32) int64_t r[4];
+    alignas(32) int64_t t[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(r), run);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(t), total);
+    // difference i = 4j + k is added to GROUP - i running values, its lane
+    // added it to GROUP / 4 - j of them
+    int64_t const weighted = 4 * ((t[0] + t[1]) + (t[2] + t[3])) - (r[1] + 2 * r[2] + 3 * r[3]);
+    sum += int64_t(GROUP) * v + weighted;
+    v += (r[0] + r[1]) + (r[2] + r[3]);
+}
+#endif
+
+using GroupsSum = void (*)(uint64_t const*, size_t, int64_t&, int64_t&);
+
+template <unsigned Bits>
+void add_groups(uint64_t const* words, size_t const groups, int64_t& v, int64_t& sum) noexcept
+{
+    for (size_t g = 0; g < groups; ++g)
+        add_group<Bits>(words + g * Bits, v, sum);
+}
+
+#if ARENA_X86_SIMD
+template <unsigned Bits>
+ARENA_TARGET("avx2")
+void add_groups_avx2(uint64_t const* words, size_t const groups, int64_t& v, int64_t& sum) noexcept
+{
+    for (size_t g = 0; g < groups; ++g)
+        add_group_avx2<Bits>(words + g * Bits, v, sum);
+}
+#endif
+
+template <unsigned Bits>
+struct GroupsSumTable
+{
+    static void fill(GroupsSum* table, GroupsSum* simd) noexcept
+    {
+        table[Bits] = &add_groups<Bits>;
+#if ARENA_X86_SIMD
+        simd[Bits] = &add_groups_avx2<Bits>;
+#else
+        simd[Bits] = &add_groups<Bits>;
+#endif
+        GroupsSumTable<Bits - 1>::fill(table, simd);
+    }
+};
+
+template <>
+struct GroupsSumTable<0>
+{
+    static void fill(GroupsSum* table, GroupsSum* simd) noexcept
+    {
+        table[0] = &add_groups<0>;
+        simd[0] = &add_groups<0>;
+    }
+};
+
+/// add_groups for codes of the given width, vectorized if the CPU has AVX2
+inline GroupsSum groups_sum(unsigned const bits) noexcept
+{
+    struct Table
+    {
+        GroupsSum f[MAX_BITS + 1];
+        GroupsSum simd[MAX_BITS + 1];
+        Table()
+        {
+            GroupsSumTable<MAX_BITS>::fill(f, simd);
+        }
+    };
+    assert(bits <= MAX_BITS);
+    static Table const table;
+    static bool const avx2 = simd_level() != SimdLevel::Scalar;
+    return avx2 ? table.simd[bits] : table.f[bits];
+}
+} // namespace delta
+
+/// Integer values of a sealed table, delta coded and bit packed
+/// The values are taken in storage order and cut into blocks of BLOCK. A
+/// block keeps its first value, its min and its max, and packs the zigzag
+/// coded difference of every other value to its predecessor in as few bits
+/// as the largest one needs. Smooth data such as height maps packs into a few
+/// bits per value. min() and max() only read the block headers, sum() runs
+/// over the differences with a loop unrolled for their width, four at a time
+/// on CPUs with AVX2.
+/// !!Important!! this object does not manage memory.
+/// The blocks, the packed words and the row offsets are taken from the
+/// ArenaAllocator passed to build.
+template <typename Int>
+class DeltaPackedValues final
+{
+    // the block headers are int32_t and MAX_BITS covers the differences of
+    // int32_t values only
+    static_assert(std::is_integral<Int>::value && std::is_signed<Int>::value && sizeof(Int) <= 4,
+                  "only signed integers of up to 32 bits are packed");
+
+    struct Block
+    {
+        int32_t first;
+        int32_t min;
+        int32_t max;
+        // start of the packed differences in words
+        uint32_t word;
+        uint32_t bits;
+    };
+
+public:
+    // differences per block, the last block is padded with zeroes
+    static constexpr size_t DELTAS = 2 * delta::GROUP;
+    static constexpr size_t BLOCK = DELTAS + 1;
+
+    /// Pack the values of db, read with db.scan
+    /// Rows keep their storage order, row r of the packed values is row r of
+    /// db
+    template <typename Db>
+    void build(ArenaAllocator& allocator, Db const& db)
+    {
+        std::vector<uint32_t> row_offsets{0};
+        std::vector<Int> pending;
+        std::vector<uint64_t> packed;
+        std::vector<Block> built;
+        uint64_t total = 0;
+        db.scan([&](typename Db::VecValues const& v) {
+            for (Int const x : v)
+            {
+                pending.push_back(x);
+                if (pending.size() == BLOCK)
+                {
+                    pack_block(pending, packed, built);
+                    pending.clear();
+                }
+            }
+            total += v.size();
+            if (total > std::numeric_limits<uint32_t>::max())
+                throw std::runtime_error("delta pack: more than 2^32 values");
+            row_offsets.push_back(uint32_t(total));
+        });
+        if (!pending.empty())
+            pack_block(pending, packed, built);
+        // padding word for delta::unpack and add_group_avx2
+        packed.push_back(0);
+
+        count = size_t(total);
+        row_count = row_offsets.size() - 1;
+        block_count = built.size();
+        word_count = packed.size();
+        blocks = allocator.allocate<Block>(std::max(block_count, size_t(1)));
+        words = allocator.allocate<uint64_t>(word_count, CACHE_LINE_SIZE);
+        offsets = allocator.allocate<uint32_t>(row_offsets.size());
+        std::copy(built.begin(), built.end(), blocks);
+        std::copy(packed.begin(), packed.end(), words);
+        std::copy(row_offsets.begin(), row_offsets.end(), offsets);
+    }
+
+    /// Number of values
+    size_t size() const noexcept
+    {
+        return count;
+    }
+
+    size_t rows() const noexcept
+    {
+        return row_count;
+    }
+
+    /// Bytes of the blocks, the packed words and the row offsets
+    size_t bytes() const noexcept
+    {
+        return block_count * sizeof(Block) + word_count * sizeof(uint64_t) +
+               (row_count + 1) * sizeof(uint32_t);
+    }
+
+    /// Sum of the values
+    double sum() const noexcept
+    {
+        int64_t sum = 0;
+        for (size_t b = 0; b < block_count; ++b)
+        {
+            Block const& block = blocks[b];
+            size_t const n = block_size(b);
+            if (block.bits == 0)
+            {
+                sum += int64_t(n) * block.first;
+                continue;
+            }
+            int64_t v = block.first;
+            int64_t block_sum = v;
+            delta::groups_sum(block.bits)(words + block.word, DELTAS / delta::GROUP, v, block_sum);
+            // every padding difference added the last value once more
+            sum += block_sum - int64_t(BLOCK - n) * v;
+        }
+        return double(sum);
+    }
+
+    /// +inf if there are no values
+    double min() const noexcept
+    {
+        double m = std::numeric_limits<double>::infinity();
+        for (size_t b = 0; b < block_count; ++b)
+            m = std::min(m, double(blocks[b].min));
+        return m;
+    }
+
+    /// -inf if there are no values
+    double max() const noexcept
+    {
+        double m = -std::numeric_limits<double>::infinity();
+        for (size_t b = 0; b < block_count; ++b)
+            m = std::max(m, double(blocks[b].max));
+        return m;
+    }
+
+    /// Decode the values of row r to out and return how many there are
+    size_t row(size_t const r, Int* out) const noexcept
+    {
+        assert(r < row_count);
+        size_t const begin = offsets[r];
+        size_t const end = offsets[r + 1];
+        Int decoded[BLOCK];
+        for (size_t i = begin; i < end;)
+        {
+            size_t const b = i / BLOCK;
+            decode_block(b, decoded);
+            size_t const stop = std::min(end, b * BLOCK + block_size(b));
+            for (; i < stop; ++i)
+                *out++ = decoded[i - b * BLOCK];
+        }
+        return end - begin;
+    }
+
+private:
+    size_t block_size(size_t const b) const noexcept
+    {
+        return std::min(size_t(BLOCK), count - b * BLOCK);
+    }
+
+    void decode_block(size_t const b, Int* out) const noexcept
+    {
+        Block const& block = blocks[b];
+        size_t const n = block_size(b);
+        uint64_t codes[DELTAS];
+        delta::unpack(words + block.word, block.bits, n - 1, codes);
+        int64_t v = block.first;
+        out[0] = Int(v);
+        for (size_t i = 1; i < n; ++i)
+        {
+            v += delta::unzigzag(codes[i - 1]);
+            out[i] = Int(v);
+        }
+    }
+
+    static void pack_block(std::vector<Int> const& values,
+                           std::vector<uint64_t>& packed,
+                           std::vector<Block>& built)
+    {
+        size_t const n = values.size();
+        uint64_t codes[DELTAS];
+        for (size_t i = 1; i < n; ++i)
+            codes[i - 1] = delta::zigzag(int64_t(values[i]) - int64_t(values[i - 1]));
+        unsigned const bits = delta::bit_width(codes, n - 1);
+        if (packed.size() > std::numeric_limits<uint32_t>::max())
+            throw std::runtime_error("delta pack: more than 2^32 words");
+
+        Block block;
+        block.first = int32_t(values[0]);
+        block.min = int32_t(*std::min_element(values.begin(), values.end()));
+        block.max = int32_t(*std::max_element(values.begin(), values.end()));
+        block.word = uint32_t(packed.size());
+        block.bits = bits;
+        built.push_back(block);
+
+        // whole groups, so sum() needs no tail
+        size_t const begin = packed.size();
+        packed.resize(begin + DELTAS * bits / 64, 0);
+        for (size_t i = 0; i + 1 < n && bits != 0; ++i)
+        {
+            size_t const at = i * bits;
+            unsigned const shift = unsigned(at & 63);
+            packed[begin + (at >> 6)] |= codes[i] << shift;
+            if (shift + bits > 64)
+                packed[begin + (at >> 6) + 1] |= codes[i] >> (64 - shift);
+        }
+    }
+
+    Block* blocks = nullptr;
+    uint64_t* words = nullptr;
+    uint32_t* offsets = nullptr;
+    size_t count = 0;
+    size_t row_count = 0;
+    size_t block_count = 0;
+    size_t word_count = 0;
+};
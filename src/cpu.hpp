@@ -0,0 +1,91 @@
+#pragma once
+#include <cstdint>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ARENA_X86_SIMD 1
+#define ARENA_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define ARENA_X86_SIMD 1
+// MSVC emits any intrinsic regardless of /arch
+#define ARENA_TARGET(isa)
+#else
+#define ARENA_X86_SIMD 0
+#define ARENA_TARGET(isa)
+#endif
+
+#if defined(__GNUC__)
+#define ARENA_PREFETCH(addr) __builtin_prefetch(addr)
+#elif ARENA_X86_SIMD
+#define ARENA_PREFETCH(addr) _mm_prefetch((char const*)(addr), _MM_HINT_T0)
+#else
+#define ARENA_PREFETCH(addr) ((void)(addr))
+#endif
+
+// fully unroll the next loop, its trip count must be a constant
+#if defined(__clang__)
+#define ARENA_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__) && __GNUC__ >= 8
+#define ARENA_UNROLL _Pragma("GCC unroll 64")
+#else
+#define ARENA_UNROLL
+#endif
+
+enum class SimdLevel
+{
+    Scalar,
+    Avx2,
+    Avx512
+};
+
+inline SimdLevel detect_simd_level() noexcept
+{
+#if ARENA_X86_SIMD && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SimdLevel::Avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::Avx2;
+#elif ARENA_X86_SIMD && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool const osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave)
+        return SimdLevel::Scalar;
+    unsigned long long const xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    // the OS has to save the zmm/ymm state for us
+    if ((info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6)
+        return SimdLevel::Avx512;
+    if ((info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6)
+        return SimdLevel::Avx2;
+#endif
+    return SimdLevel::Scalar;
+}
+
+/// The best SIMD level of the running CPU, detected once
+inline SimdLevel simd_level() noexcept
+{
+    static SimdLevel const level = detect_simd_level();
+    return level;
+}
+
+/// Index of the highest set bit, x must not be 0
+inline unsigned floor_log2(uint64_t const x) noexcept
+{
+#if defined(__GNUC__)
+    return 63 - unsigned(__builtin_clzll(x));
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long i;
+    _BitScanReverse64(&i, x);
+    return unsigned(i);
+#else
+    unsigned r = 0;
+    for (uint64_t v = x; v >>= 1;)
+        ++r;
+    return r;
+#endif
+}
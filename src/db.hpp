@@ -1,20 +1,57 @@
 #pragma once
+#include "aggregate.hpp"
 #include "arena.hpp"
+#include "bloom.hpp"
+#include "cpu.hpp"
+#include "eytzinger.hpp"
+#include "hash_index.hpp"
+#include "key_traits.hpp"
+#include "knn.hpp"
+#include "morton.hpp"
+#include "parallel.hpp"
 #include "point.hpp"
+#include "point_scan.hpp"
+#include "ragged.hpp"
+#include "segmented.hpp"
+#include "tombstones.hpp"
 #include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
 #include <map>
+#include <memory>
 #include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
-class NaiveDb final
+/// std::map of keys to their values, the baseline of the benchmarks
+/// Alloc is the allocator template of the nodes, the buckets and the value
+/// vectors, e.g. TypedArena or TypedPool to draw them all from one arena, or
+/// std::pmr::polymorphic_allocator over an ArenaResource. Hashed stores the
+/// keys in a std::unordered_map instead.
+template <template <typename> class Alloc = std::allocator, bool Hashed = false>
+class BasicNaiveDb final
 {
 public:
-    using Map = std::map<Point, std::vector<double>>;
+    using Values = std::vector<double, Alloc<double>>;
+    using Entry = std::pair<Point const, Values>;
+    using Map = typename std::conditional<
+        Hashed,
+        std::unordered_map<Point, Values, PointHash, std::equal_to<Point>, Alloc<Entry>>,
+        std::map<Point, Values, std::less<Point>, Alloc<Entry>>>::type;
+
+    explicit BasicNaiveDb(Alloc<Entry> const& allocator = Alloc<Entry>())
+        : data{make_map(allocator, std::integral_constant<bool, Hashed>{})}
+    {
+    }
 
     /**
      * Returns nullptr is p is not in the database
      */
-    std::vector<double> const* get(Point p) const noexcept
+    Values const* get(Point p) const noexcept
     {
         auto it = data.find(p);
         if (it != data.end())
@@ -24,31 +61,56 @@ public:
         return nullptr;
     }
 
-    void insert(Point const key, std::vector<double> const value)
+    /// Empty values that allocate like the database, to fill and insert
+    Values new_values() const
+    {
+        return Values(Alloc<double>(data.get_allocator()));
+    }
+
+    void insert(Point const key, Values value)
     {
         data.insert(std::make_pair(key, std::move(value)));
     }
 
+    /// Returns false if p is not in the database
+    bool erase(Point const p)
+    {
+        return data.erase(p) != 0;
+    }
+
     void clear()
     {
         data.clear();
     }
 
-    Map::iterator begin()
+    typename Map::iterator begin()
     {
         return data.begin();
     }
-    Map::iterator end()
+    typename Map::iterator end()
     {
         return data.end();
     }
 
 private:
+    static Map make_map(Alloc<Entry> const& allocator, std::false_type /* hashed */)
+    {
+        return Map(std::less<Point>{}, allocator);
+    }
+
+    static Map make_map(Alloc<Entry> const& allocator, std::true_type /* hashed */)
+    {
+        return Map(0, PointHash{}, std::equal_to<Point>{}, allocator);
+    }
+
     Map data;
 };
 
+using NaiveDb = BasicNaiveDb<>;
+
 /// Vector with a fix capacity
-/// Ctor takes a pointer to a buffer of size capacity
+/// Ctor takes a pointer to a buffer of size capacity. Adding to a full vector
+/// throws std::length_error, the slot past the end belongs to someone else.
 /// !!Important!! this object does not manage memory.
 /// Be sure not to leak the buffer passed to the vector!
 template <typename T>
@@ -111,7 +173,8 @@ public:
 
     T& push_back(T item)
     {
-        assert(_size < capacity);
+        if (_size == capacity)
+            throw std::length_error("FixedLenView: full");
         ptr[_size] = std::move(item);
         ++_size;
         return ptr[_size - 1];
@@ -119,7 +182,8 @@ public:
 
     T& insert(size_t index, T item)
     {
-        assert(_size < capacity);
+        if (_size == capacity)
+            throw std::length_error("FixedLenView: full");
         assert(index <= _size);
         for (size_t i = _size; i > index; --i)
         {
@@ -168,17 +232,190 @@ public:
     {
         return _size;
     }
+
+    /// Set the size without constructing or destroying elements
+    /// For elements written in place through begin()
+    void resize(size_t const n) noexcept
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "resize skips destructors");
+        assert(n <= capacity);
+        _size = n;
+    }
+};
+
+/// Row of at most N values stored in place
+/// The rows of a BasicArenaDb with a compile time width: the values sit next
+/// to their count instead of in a slab, and the reductions of a row loop to N,
+/// so the compiler can unroll and vectorize them. Slots past size() hold T{}.
+/// Like FixedLenView, adding to a full row throws std::length_error.
+template <typename T, size_t N>
+class InlineRow final
+{
+    static_assert(N > 0, "rows of runtime width are FixedLenViews");
+
+    T slots[N];
+    uint32_t _size = 0;
+
+public:
+    InlineRow() : slots{}
+    {
+    }
+
+    T const& at(size_t const index) const
+    {
+        assert(index < _size);
+        return slots[index];
+    }
+
+    T& at(size_t const index)
+    {
+        assert(index < _size);
+        return slots[index];
+    }
+
+    T const& operator[](size_t const index) const
+    {
+        return at(index);
+    }
+
+    T& operator[](size_t const index)
+    {
+        return at(index);
+    }
+
+    /// i-th slot, also past size()
+    T const& slot(size_t const index) const noexcept
+    {
+        return slots[index];
+    }
+
+    T& push_back(T item)
+    {
+        if (_size == N)
+            throw std::length_error("InlineRow: full");
+        slots[_size] = std::move(item);
+        return slots[_size++];
+    }
+
+    void clear()
+    {
+        resize(0);
+    }
+
+    /// Set the size, dropped slots are reset to T{}
+    void resize(size_t const n) noexcept
+    {
+        assert(n <= N);
+        for (size_t i = n; i < _size; ++i)
+            slots[i] = T{};
+        _size = uint32_t(n);
+    }
+
+    T* begin()
+    {
+        return slots;
+    }
+
+    T* end()
+    {
+        return slots + _size;
+    }
+
+    T const* begin() const
+    {
+        return slots;
+    }
+
+    T const* end() const
+    {
+        return slots + _size;
+    }
+
+    T& back()
+    {
+        return slots[_size - 1];
+    }
+
+    T const& back() const
+    {
+        return slots[_size - 1];
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
 };
 
+/// Reductions of one row, see reduce_sum in aggregate.hpp
+template <typename T>
+double reduce_sum(ReduceKernels const& k, FixedLenView<T> const& row)
+{
+    return reduce_sum(k, row.begin(), row.size());
+}
+
+template <typename T>
+double reduce_min(ReduceKernels const& k, FixedLenView<T> const& row)
+{
+    return reduce_min(k, row.begin(), row.size());
+}
+
+template <typename T>
+double reduce_max(ReduceKernels const& k, FixedLenView<T> const& row)
+{
+    return reduce_max(k, row.begin(), row.size());
+}
+
+/// Inline rows are reduced over all N slots, the empty ones add zero
+template <typename T, size_t N>
+double reduce_sum(ReduceKernels const&, InlineRow<T, N> const& row)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < N; ++i)
+        sum += double(row.slot(i));
+    return sum;
+}
+
+template <typename T, size_t N>
+double reduce_min(ReduceKernels const&, InlineRow<T, N> const& row)
+{
+    double m = std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < N; ++i)
+        m = i < row.size() ? std::min(m, double(row.slot(i))) : m;
+    return m;
+}
+
+template <typename T, size_t N>
+double reduce_max(ReduceKernels const&, InlineRow<T, N> const& row)
+{
+    double m = -std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < N; ++i)
+        m = i < row.size() ? std::max(m, double(row.slot(i))) : m;
+    return m;
+}
+
+/// Joins a key array with rows of values
+/// The row of the i-th key is given by a row index array, so the keys can be
+/// reordered without moving the values
+/// Rows marked in dead are skipped up to last, the end of the keys
 template <typename T1, typename T2>
 class JoinIterator
 {
     T1* a;
-    T2* b;
+    uint32_t const* row;
+    SegmentedArray<T2>* b;
+    T1* last;
+    Tombstones const* dead;
 
 public:
-    JoinIterator(T1* a, T2* b) : a(a), b(b)
+    JoinIterator(T1* a,
+                 uint32_t const* row,
+                 SegmentedArray<T2>* b,
+                 T1* last = nullptr,
+                 Tombstones const* dead = nullptr)
+        : a(a), row(row), b(b), last(last), dead(dead)
     {
+        skip_dead();
     }
 
     JoinIterator(JoinIterator const&) = default;
@@ -190,12 +427,12 @@ public:
     }
     T2& second()
     {
-        return *b;
+        return (*b)[*row];
     }
 
     bool operator==(JoinIterator<T1, T2> const& other) const
     {
-        return a == other.a && b == other.b;
+        return a == other.a && row == other.row;
     }
 
     bool operator!=(JoinIterator<T1, T2> const& other) const
@@ -206,137 +443,1762 @@ public:
     JoinIterator& operator++()
     {
         ++a;
-        ++b;
+        ++row;
+        skip_dead();
         return *this;
     }
 
     JoinIterator operator++(int)
     {
-        auto* a = this->a++;
-        auto* b = this->b++;
-        return JoinIterator{a, b};
+        JoinIterator const old = *this;
+        ++*this;
+        return old;
     }
 
     std::pair<T1&, T2&> operator*()
     {
-        return std::make_pair(*a, *b);
+        return std::pair<T1&, T2&>(first(), second());
     }
 
     JoinIterator<T1, T2>* operator->()
     {
         return this;
     }
+
+private:
+    void skip_dead() noexcept
+    {
+        if (dead == nullptr || dead->size() == 0)
+            return;
+        while (a != last && dead->contains(*row))
+        {
+            ++a;
+            ++row;
+        }
+    }
+};
+
+enum class KeyOrder
+{
+    // by x, then by y
+    Lexicographic,
+    // along the Z-order curve, keeps 2D neighbourhoods close together
+    Morton
+};
+
+/// How lookups search the sorted prefix of the keys
+enum class SearchLayout
+{
+    // std::lower_bound over the keys
+    LowerBound,
+    // binary search without branches on the comparisons, prefetches both
+    // possible next probes
+    Branchless,
+    // separate Eytzinger ordered copy of the key codes, rebuilt by sort()
+    Eytzinger
+};
+
+enum class SortAlgorithm
+{
+    // quicksort, can use several threads
+    Quicksort,
+    // LSD radix sort of 64 bit codes of the keys, always single threaded
+    Radix
+};
+
+/// How ArenaDb::sort orders the keys and spreads its work over threads
+struct SortOptions
+{
+    SortAlgorithm algorithm = SortAlgorithm::Quicksort;
+    /// Threads a sort may use, including the calling one
+    /// 0 uses all hardware threads
+    unsigned threads = 1;
+    /// Ranges shorter than this are sorted by a single thread
+    size_t sequential_cutoff = size_t(1) << 15;
+};
+
+/// How ArenaDb stores the values of its rows
+enum class ValueLayout
+{
+    // every row owns value_capacity doubles in a slab
+    Fixed,
+    // rows take the room they are inserted with, sort() and seal() pack
+    // their values back to back
+    Ragged
+};
+
+/// Key orders of BasicArenaDb
+/// Less orders the keys. Orders with codes also map a key to a 64 bit code
+/// that orders like Less and back, for the radix sort and the code searches.
+template <typename Key, bool Codes = KeyTraits<Key>::has_codes>
+struct LexicographicOrder
+{
+    using Less = std::less<Key>;
+    static constexpr bool has_codes = false;
+};
+
+template <typename Key>
+struct LexicographicOrder<Key, true>
+{
+    using Less = std::less<Key>;
+    static constexpr bool has_codes = true;
+
+    static uint64_t encode(Key const k) noexcept
+    {
+        return KeyTraits<Key>::code(k);
+    }
+
+    static Key decode(uint64_t const code) noexcept
+    {
+        return KeyTraits<Key>::from_code(code);
+    }
+};
+
+struct MortonOrder
+{
+    using Less = MortonLess;
+    static constexpr bool has_codes = true;
+
+    static uint64_t encode(Point const p) noexcept
+    {
+        return morton::encode(p);
+    }
+
+    static Point decode(uint64_t const code) noexcept
+    {
+        return morton::decode(code);
+    }
+};
+
+/// The Morton order of spatial keys, keys that are not 2D points only have
+/// their lexicographic order
+template <typename Key, bool Spatial = KeyTraits<Key>::spatial>
+struct MortonOrderOf
+{
+    using type = LexicographicOrder<Key>;
+};
+
+template <typename Key>
+struct MortonOrderOf<Key, true>
+{
+    using type = MortonOrder;
 };
 
-class ArenaDb final
+/// Values are stored in slab segments, every row owns value_capacity
+/// consecutive values and consecutive rows are adjacent within a segment.
+/// Rows never move, sorting only permutes the keys and their row indices, so
+/// VecValues pointers stay valid for the lifetime of the database, or until
+/// the next compact().
+/// In the ragged layout the values of a row move when it is sealed, the
+/// VecValues pointers stay valid but pointers to the values do not.
+/// The database grows as needed: each new segment doubles the row capacity
+/// and the key and row index arrays are regrown geometrically.
+/// Key is described by KeyTraits. A row width N other than 0 fixes
+/// value_capacity at compile time and stores the values inline in the rows
+/// instead of in slabs.
+template <typename Key, typename Value = double, size_t N = 0>
+class BasicArenaDb final
 {
+    using Traits = KeyTraits<Key>;
+    using Lexicographic = LexicographicOrder<Key>;
+    using Morton = typename MortonOrderOf<Key>::type;
+    template <typename Order>
+    using HasCodes = std::integral_constant<bool, Order::has_codes>;
+    using IsSpatial = std::integral_constant<bool, Traits::spatial>;
+    using IsInline = std::integral_constant<bool, (N > 0)>;
+
 public:
-    using VecValues = FixedLenView<double>;
-    using VecKeys = FixedLenView<Point>;
+    using VecValues =
+        typename std::conditional<N == 0, FixedLenView<Value>, InlineRow<Value, N>>::type;
+    using VecKeys = FixedLenView<Key>;
+    using Neighbour = KnnCandidate;
 
-    explicit ArenaDb() = delete;
-    explicit ArenaDb(size_t key_capacity, size_t value_capacity = 30)
-        : value_capacity{value_capacity}
-        , allocator{}
-        , keys{allocator.allocate<Point>(key_capacity), key_capacity}
-        , values{allocator.allocate<VecValues>(key_capacity), key_capacity}
+    explicit BasicArenaDb() = delete;
+    /// key_capacity is a hint, the database grows beyond it
+    /// source selects where the arena takes its memory from
+    explicit BasicArenaDb(size_t key_capacity,
+                          size_t value_capacity = N == 0 ? 30 : N,
+                          ChunkSource source = ChunkSource::Heap)
+        : key_capacity{std::max(key_capacity, size_t(1))}
+        , value_capacity{value_capacity}
+        , allocator{DEFAULT_PAGE_SIZE, GrowthPolicy{}, source}
+        , keys{allocator.allocate<Key>(this->key_capacity, CACHE_LINE_SIZE), this->key_capacity}
+        , values{this->key_capacity}
+        , rows{allocator.allocate<uint32_t>(this->key_capacity), this->key_capacity}
     {
+        assert(N == 0 || value_capacity == N);
     }
 
-    JoinIterator<Point, VecValues> begin()
+    JoinIterator<Key, VecValues> begin()
     {
-        return JoinIterator<Point, VecValues>{keys.begin(), values.begin()};
+        return JoinIterator<Key, VecValues>{
+            keys.begin(), rows.begin(), &values, keys.end(), &dead};
     }
 
-    JoinIterator<Point, VecValues> end()
+    JoinIterator<Key, VecValues> end()
     {
-        return JoinIterator<Point, VecValues>{keys.end(), values.end()};
+        return JoinIterator<Key, VecValues>{keys.end(), rows.end(), &values};
     }
 
-    VecValues const* get(Point const p) const noexcept
+    /// Values of p, nullptr if it is not in the database
+    /// A ragged row sealed by sort() or seal() takes no more values, see insert
+    VecValues const* get(Key const p) const noexcept
     {
-        size_t const ind = find(p);
-        if (ind == size)
+        if (bloom.enabled() && !bloom.may_contain(p))
+            return nullptr;
+        size_t const row = find_row(p);
+        if (row == npos)
+        {
+            if (bloom.enabled())
+                bloom.note_false_positive();
             return nullptr;
-        return &values.at(ind);
+        }
+        return &values.at(row);
+    }
+
+    /// Look up n keys at once, out[i] is set to the values of batch[i] or
+    /// nullptr
+    /// Unsorted batches are searched in groups: every key of a group has its
+    /// next probe prefetched before any of them is read, so their cache misses
+    /// overlap instead of adding up. A batch sorted in key order is merged
+    /// against the sorted keys instead.
+    void get_many(Key const* batch, size_t const n, VecValues const** out) const
+    {
+        if (index.enabled())
+        {
+            get_many_hashed(batch, n, out);
+            return;
+        }
+        if (order == KeyOrder::Morton)
+            get_many_with<Morton>(batch, n, out);
+        else
+            get_many_with<Lexicographic>(batch, n, out);
+    }
+
+    /// get_many with the results taken from scratch
+    /// They live until scratch is rewound past them, see ArenaScope
+    VecValues const** get_many(Key const* batch, size_t const n, ArenaAllocator& scratch) const
+    {
+        VecValues const** const out = scratch.allocate<VecValues const*>(n);
+        get_many(batch, n, out);
+        return out;
     }
 
     // Inserting the same key twice is UB!
-    VecValues* insert(Point const p)
+    VecValues* insert(Key const p)
+    {
+        return insert(p, value_capacity);
+    }
+
+    /// Insert p with room for capacity values
+    /// Only the ragged layout takes more than value_capacity. Ragged rows are
+    /// read-only once sort() or seal() packed them: their room shrinks to
+    /// their size, adding a value throws std::length_error.
+    VecValues* insert(Key const p, size_t const capacity)
     {
+        assert(values_layout == ValueLayout::Ragged || capacity <= value_capacity);
+        if (size == key_capacity)
+            grow_keys(size + 1);
+        uint32_t const row = uint32_t(values.size());
         keys.push_back(p);
-        values.push_back(VecValues{allocator.allocate<double>(value_capacity), value_capacity});
+        rows.push_back(row);
+        VecValues& v = values.push_back(allocator, new_row(row, capacity, IsInline{}));
+        if (index.enabled())
+            index.insert(allocator, p, row);
+        if (bloom.enabled())
+        {
+            if (size >= bloom.capacity())
+                rebuild_bloom_filter(2 * size, bloom.bits_per_key());
+            bloom.insert(p);
+        }
         ++size;
 
-        return &values.back();
+        return &v;
+    }
+
+    /// Erase p, returns false if it is not in the database
+    /// The row gets a tombstone and loses its values right away, lookups,
+    /// iteration and the reductions skip it. Its key leaves the key arrays at
+    /// the next sort(), its memory is reclaimed by compact(), which runs by
+    /// itself once the share of erased rows passes the compaction threshold.
+    bool erase(Key const p)
+    {
+        size_t const row = find_row(p);
+        if (row == npos)
+            return false;
+        dead.insert(allocator, row, values.size());
+        values.at(row).clear();
+        index.erase(p);
+        ++erased_keys;
+        if (double(dead.size()) > compaction_share * double(values.size()))
+            compact();
+        return true;
+    }
+
+    /// Compact once more than this share of the rows is erased
+    /// 1 or more never compacts by itself
+    void set_compaction_threshold(double const share) noexcept
+    {
+        assert(share > 0.0);
+        compaction_share = share;
+    }
+
+    double compaction_threshold() const noexcept
+    {
+        return compaction_share;
+    }
+
+    /// Number of erased rows whose memory is not reclaimed yet
+    size_t erased() const noexcept
+    {
+        return dead.size();
+    }
+
+    /// Rebuild the live rows into a fresh arena and release the old one
+    /// The keys are sorted first, the live rows are copied in key order, so
+    /// the compacted table is fully sorted and its scans follow the key
+    /// order. Rows are renumbered and their values move: VecValues pointers
+    /// and Neighbour rows from before do not survive a compaction.
+    void compact()
+    {
+        if (dead.size() == 0)
+            return;
+        sort();
+        BasicArenaDb fresh{size, value_capacity, allocator.source()};
+        fresh.values_layout = values_layout;
+        fresh.scale = scale;
+        fresh.order = order;
+        fresh.layout = layout;
+        fresh.sort_settings = sort_settings;
+        fresh.tail_scan = tail_scan;
+        fresh.compaction_share = compaction_share;
+        if (index.enabled())
+            fresh.index.reserve(fresh.allocator, size);
+        bool const ragged_rows = values_layout == ValueLayout::Ragged;
+        for (size_t i = 0; i < size; ++i)
+        {
+            VecValues const& v = values.at(rows.at(i));
+            VecValues& copy = *fresh.insert(keys.at(i), ragged_rows ? v.size() : value_capacity);
+            for (Value const x : v)
+                copy.push_back(x);
+        }
+        if (bloom.enabled())
+            fresh.enable_bloom_filter(bloom.bits_per_key());
+        if (knn.enabled())
+            fresh.knn.enable();
+        fresh.seal();
+        fresh.sorted_all();
+        *this = std::move(fresh);
+    }
+
+    /// Make room for n keys in total, so inserting them does not regrow the
+    /// key arrays
+    void reserve(size_t const n)
+    {
+        if (n > key_capacity)
+            grow_keys(n);
     }
 
     void clear()
     {
         keys.clear();
+        rows.clear();
         values.clear();
+        ragged.clear();
+        index.clear();
+        bloom.clear();
+        eytzinger.clear();
+        knn.clear();
+        dead.clear();
+        erased_keys = 0;
+        size = 0;
+        sorted = 0;
     }
 
+    /// Sort the keys inserted since the last sort and merge them into the
+    /// sorted prefix, the prefix itself is only moved, never re-sorted
+    /// Keys of erased rows are dropped first
     void sort()
     {
+        sort(sort_settings);
+    }
+
+    /// Sort with options other than the ones set for the database
+    void sort(SortOptions const& options)
+    {
+        seal();
+        if (drop_erased_keys() && sorted == size)
+            sorted_all();
         if (sorted == size)
             return;
-        sort_impl(0, size);
-        sorted = size;
+        if (order == KeyOrder::Morton)
+            sort_with<Morton>(options);
+        else
+            sort_with<Lexicographic>(options);
+        sorted_all();
     }
 
-private:
-    size_t find(Point const p) const noexcept
+    /// Sort with the merge and radix buffers taken from scratch
+    /// They are freed when the sort returns, instead of staying in the arena
+    /// of the database for the next sort
+    void sort(SortOptions const& options, ArenaAllocator& scratch)
     {
-        auto const* const begin = keys.begin();
-        auto const* end = begin + sorted;
-        auto const* it = std::lower_bound(begin, end, p);
-        if (it == end || *it != p)
+        ArenaScope const scope{scratch};
+        // dropping erased keys never makes the tail longer
+        size_t const n = std::max(size - sorted, size_t(1));
+        size_t const own_capacity = scratch_capacity;
+        Key* const own_keys = scratch_keys;
+        uint32_t* const own_rows = scratch_rows;
+        size_t const own_codes_capacity = codes_capacity;
+        uint64_t* const own_codes = scratch_codes;
+        scratch_capacity = n;
+        scratch_keys = scratch.allocate<Key>(n);
+        scratch_rows = scratch.allocate<uint32_t>(n);
+        codes_capacity = options.algorithm == SortAlgorithm::Radix ? n : 0;
+        scratch_codes = codes_capacity != 0 ? scratch.allocate<uint64_t>(2 * n) : nullptr;
+        auto const restore = [&] {
+            scratch_capacity = own_capacity;
+            scratch_keys = own_keys;
+            scratch_rows = own_rows;
+            codes_capacity = own_codes_capacity;
+            scratch_codes = own_codes;
+        };
+        try
         {
-            end = keys.end();
-            it = std::find(begin + sorted, end, p);
+            sort(options);
         }
-        return it - begin;
+        catch (...)
+        {
+            restore();
+            throw;
+        }
+        restore();
     }
 
-    // quicksort
-    void sort_impl(size_t begin, size_t end)
+    /// Store values in the given layout, only while the database is empty
+    /// Rows of a compile time width are always fixed
+    void set_value_layout(ValueLayout const l) noexcept
+    {
+        assert(size == 0);
+        assert(N == 0 || l == ValueLayout::Fixed);
+        values_layout = l;
+    }
+
+    ValueLayout value_layout() const noexcept
     {
-        if (begin == end)
+        return values_layout;
+    }
+
+    /// Fixed-point values: the rows hold integers that stand for value * s
+    /// The reductions return decoded values, see to_fixed in codec.hpp for
+    /// the encoding
+    void set_value_scale(double const s) noexcept
+    {
+        assert(s > 0.0);
+        scale = s;
+    }
+
+    double value_scale() const noexcept
+    {
+        return scale;
+    }
+
+    /// Pack the values of the rows inserted since the last seal, without
+    /// their unused capacity
+    /// Sealed rows are full, their values can be changed but not added to.
+    /// sort() seals too. Does nothing in the fixed layout.
+    void seal()
+    {
+        seal_rows(IsInline{});
+    }
+
+    /// Bytes of memory the database holds
+    size_t memory_usage() const noexcept
+    {
+        return allocator.capacity() + ragged.heap_bytes();
+    }
+
+    /// Change the order keys are sorted in
+    /// The whole table is re-sorted by the next call to sort()
+    /// Only spatial keys have a Morton order
+    void set_key_order(KeyOrder const o) noexcept
+    {
+        assert(Traits::spatial || o == KeyOrder::Lexicographic);
+        if (o == order)
             return;
-        size_t pivot = partition(begin, end);
-        sort_impl(begin, pivot);
-        // skip the pivot
-        sort_impl(pivot + 1, end);
+        order = o;
+        sorted = 0;
+        eytzinger.clear();
     }
 
-    size_t partition(size_t begin, size_t end)
+    KeyOrder key_order() const noexcept
     {
-        using std::swap;
-        --end;
-        size_t pivot = end;
-        size_t i = begin;
+        return order;
+    }
 
-        for (size_t j = begin; j != end; ++j)
+    /// Change how lookups search the sorted prefix
+    /// The Eytzinger layout is built right away from the current prefix
+    /// Keys without codes are always searched with lower_bound
+    void set_search_layout(SearchLayout const l)
+    {
+        layout = l;
+        if (layout == SearchLayout::Eytzinger)
+            build_eytzinger();
+        else
+            eytzinger.clear();
+    }
+
+    SearchLayout search_layout() const noexcept
+    {
+        return layout;
+    }
+
+    /// SIMD level of the scan over the unsorted keys, defaults to the best
+    /// the CPU supports
+    void set_tail_scan_level(SimdLevel const level) noexcept
+    {
+        tail_scan = find_point_kernel(level);
+    }
+
+    /// Options used by sort() without arguments
+    void set_sort_options(SortOptions const& options) noexcept
+    {
+        sort_settings = options;
+    }
+
+    SortOptions const& sort_options() const noexcept
+    {
+        return sort_settings;
+    }
+
+    /// Call f(Point const&, VecValues const&) for every key in the rectangle
+    /// [x0, x1] x [y0, y1]
+    /// Keys in the sorted prefix are visited in key order, only ranges that
+    /// intersect the rectangle are read. The unsorted tail is scanned.
+    template <typename F>
+    void query_rect(int x0, int y0, int x1, int y1, F&& f) const
+    {
+        static_assert(Traits::spatial, "rectangle queries need 2D keys");
+        if (order == KeyOrder::Morton)
+            query_rect_morton(x0, y0, x1, y1, f);
+        else
+            query_rect_lexicographic(x0, y0, x1, y1, f);
+
+        for (size_t i = sorted; i < size; ++i)
         {
-            if (keys.at(j) < keys.at(pivot))
-            {
-                swap(keys.at(i), keys.at(j));
-                swap(values.at(i), values.at(j));
-                ++i;
-            }
+            if (in_rect(keys.at(i), x0, y0, x1, y1) && !dead.contains(rows.at(i)))
+                f(keys.at(i), values.at(rows.at(i)));
         }
-        swap(keys.at(i), keys.at(pivot));
-        swap(values.at(i), values.at(pivot));
-        return i;
     }
 
-    size_t sorted = 0;
-    size_t size = 0;
-    size_t value_capacity;
-    ArenaAllocator allocator;
-
-    VecKeys keys;
-    FixedLenView<VecValues> values;
+    /// Keep a hash index of the keys so lookups are O(1) regardless of how
+    /// much of the table is sorted
+    /// The index is built from the current keys and kept up to date by insert
+    void enable_hash_index()
+    {
+        if (index.enabled())
+            return;
+        index.reserve(allocator, std::max(size, key_capacity));
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (!dead.contains(rows.at(i)))
+                index.insert(allocator, keys.at(i), rows.at(i));
+        }
+    }
+
+    /// Check a blocked Bloom filter of the keys before searching, so most
+    /// lookups of absent keys return without touching the keys
+    /// The filter is kept up to date by insert and rebuilt at twice the size
+    /// when the keys outgrow it
+    void enable_bloom_filter(double const bits_per_key = 10.0)
+    {
+        rebuild_bloom_filter(std::max(size, key_capacity), bits_per_key);
+    }
+
+    /// Counters of the Bloom filter, all zero while it is disabled
+    BloomStats const& bloom_stats() const noexcept
+    {
+        return bloom.statistics();
+    }
+
+    void reset_bloom_stats() noexcept
+    {
+        bloom.reset_statistics();
+    }
+
+    /// Keep a k-d tree of the keys for nearest(), rebuilt by every sort()
+    /// Keys inserted since the last sort are checked one by one
+    void enable_knn_index()
+    {
+        static_assert(Traits::spatial, "nearest neighbours need 2D keys");
+        if (knn.enabled())
+            return;
+        knn.enable();
+        knn.build(allocator, keys.begin(), rows.begin(), size);
+    }
+
+    /// Find the k keys closest to q
+    /// Writes up to k neighbours to out, nearest first, and returns how many
+    /// were written
+    /// Without enable_knn_index() every key is checked, as are all keys
+    /// while the tree holds keys of erased rows
+    size_t nearest(Point const q, size_t const k, Neighbour* out) const
+    {
+        static_assert(Traits::spatial, "nearest neighbours need 2D keys");
+        size_t found = 0;
+        size_t tail = 0;
+        if (knn.enabled() && erased_keys == 0)
+        {
+            found = knn.nearest(q, k, out, found);
+            tail = knn.size();
+        }
+        for (size_t i = tail; i < size && k != 0; ++i)
+        {
+            if (dead.contains(rows.at(i)))
+                continue;
+            Neighbour const c{distance2(q, keys.at(i)), keys.at(i), rows.at(i)};
+            found = offer_candidate(out, found, k, c);
+        }
+        std::sort_heap(out, out + found);
+        return found;
+    }
+
+    /// nearest() for n query points at once
+    /// out holds k neighbours per query, the results of queries[i] start at
+    /// out + i * k and counts[i] says how many there are
+    /// Queries are answered in Z-order, so consecutive searches walk the same
+    /// parts of the tree
+    void nearest_many(Point const* queries,
+                      size_t const n,
+                      size_t const k,
+                      Neighbour* out,
+                      size_t* counts) const
+    {
+        std::vector<ZOrderQuery> z_order(n);
+        nearest_in_z_order(queries, n, k, out, counts, z_order.data());
+    }
+
+    /// nearest_many with its working space taken from scratch and freed
+    /// before it returns
+    void nearest_many(Point const* queries,
+                      size_t const n,
+                      size_t const k,
+                      Neighbour* out,
+                      size_t* counts,
+                      ArenaAllocator& scratch) const
+    {
+        ArenaScope const scope{scratch};
+        nearest_in_z_order(queries, n, k, out, counts, scratch.allocate<ZOrderQuery>(n));
+    }
+
+    VecValues const& values_of(Neighbour const& n) const noexcept
+    {
+        return values.at(n.row);
+    }
+
+    /// Call f(VecValues const&) for every row in storage order
+    /// Unlike begin()/end() this streams through the slab linearly, use it
+    /// for full scans that do not care about key order
+    template <typename F>
+    void scan(F&& f) const
+    {
+        size_t first = 0;
+        values.for_each_segment([&](VecValues const* views, size_t const n) {
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (!dead.contains(first + i))
+                    f(views[i]);
+            }
+            first += n;
+        });
+    }
+
+    /// Number of keys in the database
+    size_t key_count() const noexcept
+    {
+        return size - erased_keys;
+    }
+
+    /// Number of values in the database
+    size_t count() const noexcept
+    {
+        size_t n = 0;
+        scan([&](VecValues const& v) { n += v.size(); });
+        return n;
+    }
+
+    double sum(ReduceKernels const& kernels = reduce_kernels()) const
+    {
+        return scale * sum_rows(kernels, IsInline{});
+    }
+
+    double min(ReduceKernels const& kernels = reduce_kernels()) const
+    {
+        return scale * min_rows(kernels, IsInline{});
+    }
+
+    double max(ReduceKernels const& kernels = reduce_kernels()) const
+    {
+        return scale * max_rows(kernels, IsInline{});
+    }
+
+    /// Returns NaN if the database holds no values
+    double mean(ReduceKernels const& kernels = reduce_kernels()) const
+    {
+        return sum(kernels) / double(count());
+    }
+
+    /// Reduce the values of every key into out
+    /// out must hold key_count() doubles, they are written in the order of
+    /// begin()/end()
+    void reduce_each(Reduction const op,
+                     double* out,
+                     ReduceKernels const& kernels = reduce_kernels()) const
+    {
+        for (size_t pos = 0, i = 0; pos < size; ++pos)
+        {
+            if (dead.contains(rows.at(pos)))
+                continue;
+            VecValues const& v = values.at(rows.at(pos));
+            size_t const n = v.size();
+            switch (op)
+            {
+            case Reduction::Sum:
+                out[i] = scale * reduce_sum(kernels, v);
+                break;
+            case Reduction::Min:
+                out[i] = scale * reduce_min(kernels, v);
+                break;
+            case Reduction::Max:
+                out[i] = scale * reduce_max(kernels, v);
+                break;
+            case Reduction::Count:
+                out[i] = double(n);
+                break;
+            case Reduction::Mean:
+                out[i] = scale * reduce_sum(kernels, v) / double(n);
+                break;
+            }
+            ++i;
+        }
+    }
+
+    /// reduce_each into key_count() doubles taken from scratch
+    /// They live until scratch is rewound past them, see ArenaScope
+    double* reduce_each(Reduction const op,
+                        ArenaAllocator& scratch,
+                        ReduceKernels const& kernels = reduce_kernels()) const
+    {
+        double* const out = scratch.allocate<double>(key_count(), CACHE_LINE_SIZE);
+        reduce_each(op, out, kernels);
+        return out;
+    }
+
+private:
+    // Morton code of a query point and its index
+    using ZOrderQuery = std::pair<uint64_t, uint32_t>;
+
+    /// Answer the queries in the order of their Morton codes, z_order holds
+    /// room for n of them
+    void nearest_in_z_order(Point const* queries,
+                            size_t const n,
+                            size_t const k,
+                            Neighbour* out,
+                            size_t* counts,
+                            ZOrderQuery* z_order) const
+    {
+        for (size_t i = 0; i < n; ++i)
+            z_order[i] = std::make_pair(morton::encode(queries[i]), uint32_t(i));
+        std::sort(z_order, z_order + n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint32_t const q = z_order[i].second;
+            counts[q] = nearest(queries[q], k, out + q * k);
+        }
+    }
+
+    // fills rows in place, see bulk_load.hpp
+    friend class BulkLoader;
+
+    /// Returns the row of p or npos if p is not in the database
+    size_t find_row(Key const p) const noexcept
+    {
+        if (index.enabled())
+        {
+            uint32_t const row = index.find(p);
+            return row == HashIndex<Key>::npos ? npos : row;
+        }
+        if (order == KeyOrder::Morton)
+            return find_row_with<Morton>(p, HasCodes<Morton>{});
+        return find_row_with<Lexicographic>(p, HasCodes<Lexicographic>{});
+    }
+
+    template <typename Order>
+    size_t find_row_with(Key const p, std::true_type /* has codes */) const noexcept
+    {
+        if (layout == SearchLayout::Eytzinger && eytzinger.size() == sorted)
+        {
+            uint32_t const row = eytzinger.find(Order::encode(p));
+            if (row != EytzingerIndex::npos && !dead.contains(row))
+                return row;
+            return live_row(find_in_tail(p), p);
+        }
+        size_t const ind = layout == SearchLayout::Branchless
+                               ? find_branchless(p, &Order::encode)
+                               : find(p, typename Order::Less{});
+        return live_row(ind, p);
+    }
+
+    template <typename Order>
+    size_t find_row_with(Key const p, std::false_type /* has codes */) const noexcept
+    {
+        return live_row(find(p, typename Order::Less{}), p);
+    }
+
+    /// Row of the key at position ind, npos if ind is size
+    /// An erased key may have been inserted again since, its live row is
+    /// further down the tail
+    size_t live_row(size_t ind, Key const p) const noexcept
+    {
+        while (ind != size && dead.contains(rows.at(ind)))
+            ind = find_in_tail(p, std::max(ind + 1, sorted));
+        return ind == size ? npos : rows.at(ind);
+    }
+
+    /// Values of row, nullptr if it is erased
+    VecValues const* live_values(size_t const row) const noexcept
+    {
+        return dead.contains(row) ? nullptr : &values.at(row);
+    }
+
+    /// Returns the position of p in keys or size if p is not in the database
+    template <typename Less>
+    size_t find(Key const p, Less const less) const noexcept
+    {
+        auto const* const begin = keys.begin();
+        auto const* end = begin + sorted;
+        auto const* it = std::lower_bound(begin, end, p, less);
+        if (it == end || *it != p)
+            return find_in_tail(p);
+        return it - begin;
+    }
+
+    /// Position of p among the unsorted keys [first, size), size if it is
+    /// not there
+    size_t find_in_tail(Key const p) const noexcept
+    {
+        return find_in_tail(p, sorted);
+    }
+
+    size_t find_in_tail(Key const p, size_t const first) const noexcept
+    {
+        return first + scan_tail(keys.begin() + first, size - first, p);
+    }
+
+    /// Points are compared a SIMD register at a time
+    size_t scan_tail(Point const* tail, size_t const n, Point const p) const noexcept
+    {
+        return tail_scan(tail, n, p);
+    }
+
+    template <typename K>
+    size_t scan_tail(K const* tail, size_t const n, K const p) const noexcept
+    {
+        return std::find(tail, tail + n, p) - tail;
+    }
+
+    /// find with a binary search that compares key codes
+    /// Every step only picks between two pointers, which compiles to a
+    /// conditional move instead of an unpredictable branch
+    template <typename Encode>
+    size_t find_branchless(Key const p, Encode const encode) const noexcept
+    {
+        auto const* const begin = keys.begin();
+        if (sorted != 0)
+        {
+            uint64_t const code = encode(p);
+            Key const* base = begin;
+            size_t n = sorted;
+            while (n > 1)
+            {
+                size_t const half = n / 2;
+                // both possible next probes
+                ARENA_PREFETCH(base + half / 2);
+                ARENA_PREFETCH(base + half + half / 2);
+                base = encode(base[half]) < code ? base + half : base;
+                n -= half;
+            }
+            base += encode(*base) < code;
+            if (base != begin + sorted && *base == p)
+                return base - begin;
+        }
+        return find_in_tail(p);
+    }
+
+    void get_many_hashed(Key const* batch, size_t const n, VecValues const** out) const
+    {
+        for (size_t first = 0; first < n; first += GET_MANY_GROUP)
+        {
+            size_t const end = std::min(n, first + GET_MANY_GROUP);
+            for (size_t i = first; i < end; ++i)
+                index.prefetch(batch[i]);
+            for (size_t i = first; i < end; ++i)
+            {
+                uint32_t const row = index.find(batch[i]);
+                out[i] = row == HashIndex<Key>::npos ? nullptr : &values.at(row);
+            }
+        }
+    }
+
+    template <typename Order>
+    void get_many_with(Key const* batch, size_t const n, VecValues const** out) const
+    {
+        typename Order::Less const less{};
+        if (n > 1 && std::is_sorted(batch, batch + n, less))
+            merge_join(batch, n, out, less);
+        else
+            search_many<Order>(batch, n, out, HasCodes<Order>{});
+
+        if (sorted == size)
+            return;
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (out[i] != nullptr)
+                continue;
+            // only the tail scan is worth skipping, the batch is already
+            // searched
+            if (bloom.enabled() && !bloom.may_contain(batch[i]))
+                continue;
+            size_t const row = live_row(find_in_tail(batch[i]), batch[i]);
+            if (row != npos)
+                out[i] = &values.at(row);
+            else if (bloom.enabled())
+                bloom.note_false_positive();
+        }
+    }
+
+    template <typename Order>
+    void search_many(Key const* batch,
+                     size_t const n,
+                     VecValues const** out,
+                     std::true_type /* has codes */) const
+    {
+        if (layout == SearchLayout::Eytzinger && eytzinger.size() == sorted)
+            get_many_eytzinger(batch, n, out, &Order::encode);
+        else
+            get_many_branchless(batch, n, out, &Order::encode);
+    }
+
+    /// Keys without codes are searched one at a time
+    template <typename Order>
+    void search_many(Key const* batch,
+                     size_t const n,
+                     VecValues const** out,
+                     std::false_type /* has codes */) const
+    {
+        auto const* const begin = keys.begin();
+        auto const* const end = begin + sorted;
+        for (size_t i = 0; i < n; ++i)
+        {
+            auto const* it = std::lower_bound(begin, end, batch[i], typename Order::Less{});
+            out[i] = it != end && *it == batch[i] ? live_values(rows.at(it - begin)) : nullptr;
+        }
+    }
+
+    /// Search the sorted prefix for a sorted batch
+    /// Every key is found by galloping forward from the previous one, so the
+    /// batch costs O(n log(sorted / n)) comparisons and reads the keys in order
+    template <typename Less>
+    void merge_join(Key const* batch,
+                    size_t const n,
+                    VecValues const** out,
+                    Less const less) const
+    {
+        auto const* const begin = keys.begin();
+        size_t pos = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            Key const p = batch[i];
+            size_t lo = pos;
+            size_t hi = pos;
+            for (size_t step = 1; hi < sorted && less(keys.at(hi), p); step *= 2)
+            {
+                lo = hi + 1;
+                hi = lo + step;
+            }
+            hi = std::min(hi, sorted);
+            pos = std::lower_bound(begin + lo, begin + hi, p, less) - begin;
+            out[i] = pos < sorted && keys.at(pos) == p ? live_values(rows.at(pos)) : nullptr;
+        }
+    }
+
+    template <typename Encode>
+    void get_many_eytzinger(Key const* batch,
+                            size_t const n,
+                            VecValues const** out,
+                            Encode const encode) const
+    {
+        uint64_t codes[GET_MANY_GROUP];
+        uint32_t found[GET_MANY_GROUP];
+        for (size_t first = 0; first < n; first += GET_MANY_GROUP)
+        {
+            size_t const m = std::min(n - first, size_t(GET_MANY_GROUP));
+            for (size_t i = 0; i < m; ++i)
+                codes[i] = encode(batch[first + i]);
+            eytzinger.find_many(codes, m, found);
+            for (size_t i = 0; i < m; ++i)
+            {
+                out[first + i] =
+                    found[i] == EytzingerIndex::npos ? nullptr : live_values(found[i]);
+            }
+        }
+    }
+
+    /// find_branchless for a group of keys at a time
+    /// The searches of a group take the same number of steps, one step of
+    /// every search is taken before the next, with its next probe prefetched
+    template <typename Encode>
+    void get_many_branchless(Key const* batch,
+                             size_t const n,
+                             VecValues const** out,
+                             Encode const encode) const
+    {
+        auto const* const begin = keys.begin();
+        uint64_t codes[GET_MANY_GROUP];
+        Key const* base[GET_MANY_GROUP];
+        for (size_t first = 0; first < n; first += GET_MANY_GROUP)
+        {
+            size_t const m = std::min(n - first, size_t(GET_MANY_GROUP));
+            if (sorted == 0)
+            {
+                std::fill(out + first, out + first + m, nullptr);
+                continue;
+            }
+            for (size_t i = 0; i < m; ++i)
+            {
+                codes[i] = encode(batch[first + i]);
+                base[i] = begin;
+            }
+            for (size_t len = sorted; len > 1;)
+            {
+                size_t const half = len / 2;
+                len -= half;
+                for (size_t i = 0; i < m; ++i)
+                {
+                    base[i] = encode(base[i][half]) < codes[i] ? base[i] + half : base[i];
+                    ARENA_PREFETCH(base[i] + len / 2);
+                }
+            }
+            for (size_t i = 0; i < m; ++i)
+            {
+                Key const* it = base[i] + (encode(*base[i]) < codes[i]);
+                bool const hit = it != begin + sorted && *it == batch[first + i];
+                out[first + i] = hit ? live_values(rows.at(it - begin)) : nullptr;
+            }
+        }
+    }
+
+    /// Remove the keys of erased rows from the key and row index arrays,
+    /// returns whether there were any
+    /// The order of the remaining keys is kept, so is the sorted prefix. Their
+    /// rows stay behind their tombstones until compact().
+    bool drop_erased_keys() noexcept
+    {
+        if (erased_keys == 0)
+            return false;
+        size_t kept = 0;
+        size_t kept_sorted = 0;
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (dead.contains(rows.at(i)))
+                continue;
+            keys.at(kept) = keys.at(i);
+            rows.at(kept) = rows.at(i);
+            kept_sorted += i < sorted;
+            ++kept;
+        }
+        keys.resize(kept);
+        rows.resize(kept);
+        size = kept;
+        sorted = kept_sorted;
+        erased_keys = 0;
+        return true;
+    }
+
+    /// Bring the indexes up to date after the whole table was sorted
+    void sorted_all()
+    {
+        sorted = size;
+        rebuild_knn(IsSpatial{});
+        if (layout == SearchLayout::Eytzinger)
+            build_eytzinger();
+    }
+
+    void rebuild_knn(std::true_type /* spatial */)
+    {
+        if (knn.enabled())
+            knn.build(allocator, keys.begin(), rows.begin(), size);
+    }
+
+    void rebuild_knn(std::false_type /* spatial */) noexcept
+    {
+    }
+
+    /// Append count rows with empty values and default keys and return the
+    /// position of the first
+    /// The caller writes the keys and values in place, then calls
+    /// index_appended or truncate
+    size_t append_rows(size_t const count)
+    {
+        size_t const first = size;
+        reserve(size + count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint32_t const row = uint32_t(values.size());
+            keys.push_back(Key{});
+            rows.push_back(row);
+            values.push_back(allocator, new_row(row, value_capacity, IsInline{}));
+            ++size;
+        }
+        return first;
+    }
+
+    /// Drop the keys from position n on, only for rows appended since the
+    /// last sort that are not in the indexes yet
+    /// row_count is the number of rows before they were appended, the rows
+    /// of the dropped keys are the last ones but sort_range may have
+    /// permuted them
+    void truncate(size_t const n, size_t const row_count) noexcept
+    {
+        assert(sorted <= n && n <= size);
+        assert(row_count + (size - n) == values.size());
+        if (n == size)
+            return;
+        values.truncate(row_count);
+        keys.resize(n);
+        rows.resize(n);
+        size = n;
+    }
+
+    /// Add the keys from position first on to the hash index and the Bloom
+    /// filter
+    void index_appended(size_t const first)
+    {
+        if (index.enabled())
+        {
+            for (size_t i = first; i < size; ++i)
+                index.insert(allocator, keys.at(i), rows.at(i));
+        }
+        if (bloom.enabled())
+        {
+            if (size > bloom.capacity())
+                rebuild_bloom_filter(2 * size, bloom.bits_per_key());
+            else
+                for (size_t i = first; i < size; ++i)
+                    bloom.insert(keys.at(i));
+        }
+    }
+
+    /// Sort the keys in [begin, end) in key order
+    /// Disjoint ranges can be sorted by several threads at once
+    void sort_range(size_t const begin, size_t const end)
+    {
+        if (order == KeyOrder::Morton)
+            sort_impl(begin, end, typename Morton::Less{});
+        else
+            sort_impl(begin, end, typename Lexicographic::Less{});
+    }
+
+    /// Merge the sorted runs of the tail into the prefix and sort the table
+    /// starts holds the position of the first key of every run, in order
+    void merge_runs(std::vector<size_t> const& starts, unsigned const threads)
+    {
+        seal();
+        if (sorted == size)
+            return;
+        if (order == KeyOrder::Morton)
+            merge_runs_with(starts, typename Morton::Less{}, threads);
+        else
+            merge_runs_with(starts, typename Lexicographic::Less{}, threads);
+        sorted_all();
+    }
+
+    /// Bottom up merge of the runs two at a time, between the tail and the
+    /// scratch buffers
+    /// The pairs of a pass are merged by up to threads threads
+    template <typename Less>
+    void merge_runs_with(std::vector<size_t> starts, Less const less, unsigned const threads)
+    {
+        size_t const n = size - sorted;
+        reserve_scratch(n);
+        Key* from_keys = keys.begin() + sorted;
+        uint32_t* from_rows = rows.begin() + sorted;
+        Key* to_keys = scratch_keys;
+        uint32_t* to_rows = scratch_rows;
+        // runs that already follow each other in order are one run
+        size_t kept = 0;
+        for (size_t const s : starts)
+        {
+            if (kept == 0 || less(keys.at(s), keys.at(s - 1)))
+                starts[kept++] = s - sorted;
+        }
+        starts.resize(kept);
+        starts.push_back(n);
+        while (starts.size() > 2)
+        {
+            size_t const runs = starts.size() - 1;
+            parallel::for_each_index((runs + 1) / 2, threads, [&](size_t const pair) {
+                size_t const a = starts[2 * pair];
+                size_t const b = starts[std::min(2 * pair + 1, runs)];
+                size_t const e = starts[std::min(2 * pair + 2, runs)];
+                size_t i = a;
+                size_t j = b;
+                for (size_t out = a; out < e; ++out)
+                {
+                    bool const left = j == e || (i < b && !less(from_keys[j], from_keys[i]));
+                    size_t const k = left ? i++ : j++;
+                    to_keys[out] = from_keys[k];
+                    to_rows[out] = from_rows[k];
+                }
+            });
+            std::vector<size_t> merged;
+            merged.reserve(runs / 2 + 2);
+            for (size_t r = 0; r < runs; r += 2)
+                merged.push_back(starts[r]);
+            merged.push_back(n);
+            starts.swap(merged);
+            std::swap(from_keys, to_keys);
+            std::swap(from_rows, to_rows);
+        }
+        if (from_keys != keys.begin() + sorted)
+        {
+            std::copy(from_keys, from_keys + n, keys.begin() + sorted);
+            std::copy(from_rows, from_rows + n, rows.begin() + sorted);
+        }
+        merge_tail(less);
+    }
+
+    void rebuild_bloom_filter(size_t const n, double const bits_per_key)
+    {
+        bloom.reserve(allocator, n, bits_per_key);
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (!dead.contains(rows.at(i)))
+                bloom.insert(keys.at(i));
+        }
+    }
+
+    void build_eytzinger()
+    {
+        if (order == KeyOrder::Morton)
+            build_eytzinger<Morton>(HasCodes<Morton>{});
+        else
+            build_eytzinger<Lexicographic>(HasCodes<Lexicographic>{});
+    }
+
+    template <typename Order>
+    void build_eytzinger(std::true_type /* has codes */)
+    {
+        eytzinger.build(allocator, keys.begin(), rows.begin(), sorted, &Order::encode);
+    }
+
+    template <typename Order>
+    void build_eytzinger(std::false_type /* has codes */) noexcept
+    {
+    }
+
+    void seal_rows(std::false_type /* inline */)
+    {
+        if (values_layout == ValueLayout::Ragged)
+            ragged.seal(allocator, values);
+    }
+
+    void seal_rows(std::true_type /* inline */) noexcept
+    {
+    }
+
+    /// Slab rows are reduced a run of rows at a time, inline rows one row at
+    /// a time over their compile time width
+    double sum_rows(ReduceKernels const& kernels, std::false_type /* inline */) const
+    {
+        double sum = 0.0;
+        for_each_span([&](Value const* p, size_t n) { sum += reduce_sum(kernels, p, n); });
+        return sum;
+    }
+
+    double sum_rows(ReduceKernels const& kernels, std::true_type /* inline */) const
+    {
+        double sum = 0.0;
+        scan([&](VecValues const& v) { sum += reduce_sum(kernels, v); });
+        return sum;
+    }
+
+    double min_rows(ReduceKernels const& kernels, std::false_type /* inline */) const
+    {
+        double m = std::numeric_limits<double>::infinity();
+        for_each_span(
+            [&](Value const* p, size_t n) { m = std::min(m, reduce_min(kernels, p, n)); });
+        return m;
+    }
+
+    double min_rows(ReduceKernels const& kernels, std::true_type /* inline */) const
+    {
+        double m = std::numeric_limits<double>::infinity();
+        scan([&](VecValues const& v) { m = std::min(m, reduce_min(kernels, v)); });
+        return m;
+    }
+
+    double max_rows(ReduceKernels const& kernels, std::false_type /* inline */) const
+    {
+        double m = -std::numeric_limits<double>::infinity();
+        for_each_span(
+            [&](Value const* p, size_t n) { m = std::max(m, reduce_max(kernels, p, n)); });
+        return m;
+    }
+
+    double max_rows(ReduceKernels const& kernels, std::true_type /* inline */) const
+    {
+        double m = -std::numeric_limits<double>::infinity();
+        scan([&](VecValues const& v) { m = std::max(m, reduce_max(kernels, v)); });
+        return m;
+    }
+
+    /// Call f(Value const*, size_t) on maximal contiguous runs of values
+    /// Full rows are adjacent in the slab, so a table of full rows is
+    /// reduced in a single call. Sealed ragged rows are a single run.
+    template <typename F>
+    void for_each_span(F&& f) const
+    {
+        if (values_layout == ValueLayout::Ragged)
+        {
+            // packed values of erased rows are only dropped by compact(),
+            // until then the sealed rows are visited one at a time
+            size_t row = 0;
+            if (dead.size() == 0)
+            {
+                if (ragged.packed_count() != 0)
+                    f(ragged.packed_values(), ragged.packed_count());
+                row = ragged.sealed();
+            }
+            for (; row < values.size(); ++row)
+            {
+                VecValues const& v = values.at(row);
+                if (v.size() != 0 && !dead.contains(row))
+                    f(v.begin(), v.size());
+            }
+            return;
+        }
+        size_t const cap = value_capacity;
+        values.for_each_segment([&](VecValues const* views, size_t const rows_in_segment) {
+            size_t row = 0;
+            while (row < rows_in_segment)
+            {
+                Value const* const begin = views[row].begin();
+                size_t n = 0;
+                while (row < rows_in_segment && views[row].size() == cap)
+                {
+                    n += cap;
+                    ++row;
+                }
+                // a partial row ends the run
+                if (row < rows_in_segment)
+                {
+                    n += views[row].size();
+                    ++row;
+                }
+                if (n != 0)
+                    f(begin, n);
+            }
+        });
+    }
+
+    /// View of the values of a new row with room for capacity values
+    VecValues new_row(size_t const row, size_t const capacity, std::false_type /* inline */)
+    {
+        if (values_layout == ValueLayout::Ragged)
+            return VecValues{ragged.allocate(capacity), capacity};
+        return VecValues{row_slab(row), value_capacity};
+    }
+
+    VecValues new_row(size_t, size_t, std::true_type /* inline */) noexcept
+    {
+        return VecValues{};
+    }
+
+    /// Start of the values of a new row
+    /// Slab segments line up with the segments of values and are allocated
+    /// when their first row is inserted, cache line aligned for the kernels
+    Value* row_slab(size_t const row)
+    {
+        size_t segment, offset;
+        values.locate(row, segment, offset);
+        if (slabs[segment] == nullptr)
+            slabs[segment] = allocator.allocate<Value>(
+                values.segment_capacity(segment) * value_capacity, CACHE_LINE_SIZE);
+        return slabs[segment] + offset * value_capacity;
+    }
+
+    /// Grow the key and row index arrays to at least n keys, at least doubling
+    /// their capacity
+    /// The old arrays are left in the arena
+    void grow_keys(size_t const n)
+    {
+        key_capacity = std::max(n, 2 * key_capacity);
+        VecKeys grown_keys{allocator.allocate<Key>(key_capacity, CACHE_LINE_SIZE), key_capacity};
+        FixedLenView<uint32_t> grown_rows{allocator.allocate<uint32_t>(key_capacity), key_capacity};
+        for (size_t i = 0; i < size; ++i)
+        {
+            grown_keys.push_back(keys.at(i));
+            grown_rows.push_back(rows.at(i));
+        }
+        keys = std::move(grown_keys);
+        rows = std::move(grown_rows);
+    }
+
+    template <typename F>
+    void query_rect_lexicographic(int x0, int y0, int x1, int y1, F& f) const
+    {
+        auto const* it = std::lower_bound(keys.begin(), keys.begin() + sorted, Point{x0, y0});
+        auto const* const end = keys.begin() + sorted;
+        while (it != end && it->x <= x1)
+        {
+            if (it->y < y0)
+            {
+                // start of a new column below the rectangle
+                it = std::lower_bound(it, end, Point{it->x, y0});
+            }
+            else if (it->y > y1)
+            {
+                // past the top of this column, skip to the next one
+                if (it->x == x1)
+                    break;
+                it = std::lower_bound(it, end, Point{it->x + 1, y0});
+            }
+            else
+            {
+                uint32_t const row = rows.at(it - keys.begin());
+                if (!dead.contains(row))
+                    f(*it, values.at(row));
+                ++it;
+            }
+        }
+    }
+
+    template <typename F>
+    void query_rect_morton(int x0, int y0, int x1, int y1, F& f) const
+    {
+        uint64_t const zmin = morton::encode(Point{x0, y0});
+        uint64_t const zmax = morton::encode(Point{x1, y1});
+        auto const* const end = keys.begin() + sorted;
+        auto const code_less = [](Point const& p, uint64_t const z) {
+            return morton::encode(p) < z;
+        };
+        auto const* it = std::lower_bound(keys.begin(), end, zmin, code_less);
+        while (it != end)
+        {
+            uint64_t const z = morton::encode(*it);
+            if (z > zmax)
+                break;
+            if (in_rect(*it, x0, y0, x1, y1))
+            {
+                uint32_t const row = rows.at(it - keys.begin());
+                if (!dead.contains(row))
+                    f(*it, values.at(row));
+                ++it;
+            }
+            else
+            {
+                // jump over the part of the curve that leaves the rectangle
+                it = std::lower_bound(it, end, morton::bigmin(z, zmin, zmax), code_less);
+            }
+        }
+    }
+
+    /// Sort the tail and merge it into the prefix
+    /// Keys without codes are quicksorted whatever the algorithm
+    template <typename Order>
+    void sort_with(SortOptions const& options)
+    {
+        typename Order::Less const less{};
+        if (options.algorithm == SortAlgorithm::Radix && Order::has_codes)
+        {
+            radix_sort<Order>(HasCodes<Order>{});
+            merge_tail(less);
+            return;
+        }
+        unsigned threads = options.threads;
+        if (threads == 0)
+            threads = parallel::hardware_threads();
+        size_t const cutoff = std::max(options.sequential_cutoff, size_t(INSERTION_SORT_THRESHOLD));
+        sort_parallel(sorted, size, less, threads, cutoff);
+        merge_tail(less);
+    }
+
+    void swap_rows(size_t const i, size_t const j)
+    {
+        using std::swap;
+        swap(keys.at(i), keys.at(j));
+        swap(rows.at(i), rows.at(j));
+    }
+
+    // quicksort
+    // Recursing into the smaller half and looping on the larger keeps the
+    // stack depth O(log n)
+    template <typename Less>
+    void sort_impl(size_t begin, size_t end, Less const less)
+    {
+        while (end - begin > INSERTION_SORT_THRESHOLD)
+        {
+            size_t pivot = partition(begin, end, less);
+            if (pivot - begin < end - pivot)
+            {
+                sort_impl(begin, pivot, less);
+                // skip the pivot
+                begin = pivot + 1;
+            }
+            else
+            {
+                sort_impl(pivot + 1, end, less);
+                end = pivot;
+            }
+        }
+        insertion_sort(begin, end, less);
+    }
+
+    /// Quicksort that hands one side of every large partition to a new thread
+    /// while it has threads to spare
+    /// The sides are disjoint, so the threads never touch the same keys
+    template <typename Less>
+    void sort_parallel(size_t const begin,
+                       size_t const end,
+                       Less const less,
+                       unsigned const threads,
+                       size_t const cutoff)
+    {
+        if (threads < 2 || end - begin < cutoff)
+        {
+            sort_impl(begin, end, less);
+            return;
+        }
+        size_t const pivot = partition(begin, end, less);
+        // split the threads in proportion to the size of each side
+        size_t const share = threads * (pivot - begin) / (end - begin);
+        unsigned const left = unsigned(std::min<size_t>(std::max<size_t>(share, 1), threads - 1));
+        std::thread helper{[=] { sort_parallel(begin, pivot, less, left, cutoff); }};
+        sort_parallel(pivot + 1, end, less, threads - left, cutoff);
+        helper.join();
+    }
+
+    template <typename Order>
+    void radix_sort(std::true_type /* has codes */)
+    {
+        radix_sort(&Order::encode, &Order::decode);
+    }
+
+    template <typename Order>
+    void radix_sort(std::false_type /* has codes */) noexcept
+    {
+    }
+
+    /// LSD radix sort of the tail
+    /// Sorts the codes of the keys together with their rows RADIX_BITS at a
+    /// time, then decodes the keys. Passes in which every code has the same
+    /// digit are skipped.
+    template <typename Encode, typename Decode>
+    void radix_sort(Encode const encode, Decode const decode)
+    {
+        size_t const n = size - sorted;
+        if (n < 2)
+            return;
+        reserve_scratch(n);
+        reserve_codes(n);
+
+        constexpr unsigned passes = (64 + RADIX_BITS - 1) / RADIX_BITS;
+        constexpr size_t buckets = size_t(1) << RADIX_BITS;
+        constexpr uint64_t digit_mask = buckets - 1;
+
+        uint64_t* codes = scratch_codes;
+        uint64_t* codes_out = scratch_codes + codes_capacity;
+        uint32_t* rows_in = rows.begin() + sorted;
+        uint32_t* rows_out = scratch_rows;
+
+        // counts of every pass in one read of the keys
+        uint32_t counts[passes][buckets] = {};
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint64_t const code = encode(keys.at(sorted + i));
+            codes[i] = code;
+            for (unsigned p = 0; p < passes; ++p)
+                ++counts[p][(code >> (p * RADIX_BITS)) & digit_mask];
+        }
+
+        for (unsigned p = 0; p < passes; ++p)
+        {
+            unsigned const shift = p * RADIX_BITS;
+            uint32_t* const offsets = counts[p];
+            if (offsets[(codes[0] >> shift) & digit_mask] == n)
+                continue;
+            uint32_t total = 0;
+            for (size_t d = 0; d < buckets; ++d)
+            {
+                uint32_t const c = offsets[d];
+                offsets[d] = total;
+                total += c;
+            }
+            for (size_t i = 0; i < n; ++i)
+            {
+                uint32_t const at = offsets[(codes[i] >> shift) & digit_mask]++;
+                codes_out[at] = codes[i];
+                rows_out[at] = rows_in[i];
+            }
+            std::swap(codes, codes_out);
+            std::swap(rows_in, rows_out);
+        }
+
+        if (rows_in != rows.begin() + sorted)
+            std::copy(rows_in, rows_in + n, rows.begin() + sorted);
+        for (size_t i = 0; i < n; ++i)
+            keys.at(sorted + i) = decode(codes[i]);
+    }
+
+    template <typename Less>
+    void insertion_sort(size_t begin, size_t end, Less const less)
+    {
+        for (size_t i = begin + 1; i < end; ++i)
+        {
+            for (size_t j = i; j > begin && less(keys.at(j), keys.at(j - 1)); --j)
+                swap_rows(j, j - 1);
+        }
+    }
+
+    template <typename Less>
+    size_t partition(size_t begin, size_t end, Less const less)
+    {
+        --end;
+        // median of three, so sorted and reverse sorted input does not
+        // degrade to quadratic time
+        size_t const mid = begin + (end - begin) / 2;
+        if (less(keys.at(mid), keys.at(begin)))
+            swap_rows(mid, begin);
+        if (less(keys.at(end), keys.at(begin)))
+            swap_rows(end, begin);
+        if (less(keys.at(mid), keys.at(end)))
+            swap_rows(mid, end);
+        size_t pivot = end;
+        size_t i = begin;
+
+        for (size_t j = begin; j != end; ++j)
+        {
+            if (less(keys.at(j), keys.at(pivot)))
+            {
+                swap_rows(i, j);
+                ++i;
+            }
+        }
+        swap_rows(i, pivot);
+        return i;
+    }
+
+    /// Merge the sorted tail [sorted, size) into the sorted prefix [0, sorted)
+    /// Works backwards from the end, so only the tail needs scratch space
+    template <typename Less>
+    void merge_tail(Less const less)
+    {
+        if (sorted == 0 || less(keys.at(sorted - 1), keys.at(sorted)))
+            return;
+
+        // prefix entries before the smallest new key stay where they are
+        auto const* const begin = keys.begin();
+        size_t const first =
+            std::upper_bound(begin, begin + sorted, keys.at(sorted), less) - begin;
+
+        size_t const n = size - sorted;
+        reserve_scratch(n);
+        std::copy(keys.begin() + sorted, keys.end(), scratch_keys);
+        std::copy(rows.begin() + sorted, rows.end(), scratch_rows);
+
+        size_t i = sorted;
+        size_t j = n;
+        size_t out = size;
+        while (j > 0)
+        {
+            --out;
+            if (i > first && less(scratch_keys[j - 1], keys.at(i - 1)))
+            {
+                --i;
+                keys.at(out) = keys.at(i);
+                rows.at(out) = rows.at(i);
+            }
+            else
+            {
+                --j;
+                keys.at(out) = scratch_keys[j];
+                rows.at(out) = scratch_rows[j];
+            }
+        }
+    }
+
+    /// Scratch buffers are reused between sorts and grow geometrically, so
+    /// repeated sorts do not keep eating the arena
+    void reserve_scratch(size_t const n)
+    {
+        if (n <= scratch_capacity)
+            return;
+        scratch_capacity = std::max(n, 2 * scratch_capacity);
+        scratch_keys = allocator.allocate<Key>(scratch_capacity);
+        scratch_rows = allocator.allocate<uint32_t>(scratch_capacity);
+    }
+
+    /// Two code buffers for radix_sort, grown like the scratch buffers
+    void reserve_codes(size_t const n)
+    {
+        if (n <= codes_capacity)
+            return;
+        codes_capacity = std::max(n, 2 * codes_capacity);
+        scratch_codes = allocator.allocate<uint64_t>(2 * codes_capacity);
+    }
+
+    // row of a key that is not in the database
+    static constexpr size_t npos = size_t(-1);
+    static constexpr size_t INSERTION_SORT_THRESHOLD = 16;
+    // keys get_many works on side by side
+    static constexpr size_t GET_MANY_GROUP = 16;
+    // 6 passes over 64 bit codes, the counts of one pass fit in L1
+    static constexpr unsigned RADIX_BITS = 11;
+
+    size_t sorted = 0;
+    size_t size = 0;
+    // keys of erased rows still in the key arrays, dropped by sort()
+    size_t erased_keys = 0;
+    double compaction_share = 0.5;
+    KeyOrder order = KeyOrder::Lexicographic;
+    ValueLayout values_layout = ValueLayout::Fixed;
+    double scale = 1.0;
+    SortOptions sort_settings;
+    SearchLayout layout = SearchLayout::LowerBound;
+    FindPointKernel tail_scan = find_point_kernel();
+    size_t key_capacity;
+    size_t value_capacity;
+    ArenaAllocator allocator;
+
+    VecKeys keys;
+    // views into the slab, indexed by row
+    SegmentedArray<VecValues> values;
+    // row index of the key at the same position
+    FixedLenView<uint32_t> rows;
+    Value* slabs[SegmentedArray<VecValues>::MAX_SEGMENTS] = {};
+    RaggedValues<Value> ragged;
+    HashIndex<Key> index;
+    BlockedBloomFilter bloom;
+    KdTree knn;
+    EytzingerIndex eytzinger;
+    Tombstones dead;
+
+    size_t scratch_capacity = 0;
+    Key* scratch_keys = nullptr;
+    uint32_t* scratch_rows = nullptr;
+    size_t codes_capacity = 0;
+    uint64_t* scratch_codes = nullptr;
 };
 
+using ArenaDb = BasicArenaDb<Point, double>;
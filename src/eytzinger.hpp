@@ -0,0 +1,158 @@
+#pragma once
+#include "arena.hpp"
+#include "cpu.hpp"
+#include "point.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+/// Eytzinger layout over caller provided arrays
+/// codes and rows are 1-based, slot 0 is unused
+namespace eytzinger
+{
+constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+/// In-order walk of the implicit tree, hands out the sorted keys in order
+template <typename Key, typename Encode>
+void fill(Key const* keys,
+          uint32_t const* key_rows,
+          size_t const n,
+          Encode const encode,
+          uint64_t* codes,
+          uint32_t* rows,
+          size_t& next,
+          size_t const k)
+{
+    if (k > n)
+        return;
+    fill(keys, key_rows, n, encode, codes, rows, next, 2 * k);
+    codes[k] = encode(keys[next]);
+    rows[k] = key_rows[next];
+    ++next;
+    fill(keys, key_rows, n, encode, codes, rows, next, 2 * k + 1);
+}
+
+/// Lay out n keys sorted in the order of encode, and their rows
+/// codes and rows need room for n + 1 entries
+template <typename Key, typename Encode>
+void layout(Key const* keys,
+            uint32_t const* key_rows,
+            size_t const n,
+            Encode const encode,
+            uint64_t* codes,
+            uint32_t* rows)
+{
+    size_t next = 0;
+    fill(keys, key_rows, n, encode, codes, rows, next, 1);
+}
+
+/// Row of the key with the given code among n laid out keys, or npos
+inline uint32_t find(uint64_t const* codes,
+                     uint32_t const* rows,
+                     size_t const n,
+                     uint64_t const code) noexcept
+{
+    size_t k = 1;
+    while (k <= n)
+    {
+        ARENA_PREFETCH(codes + 8 * k);
+        k = 2 * k + (codes[k] < code);
+    }
+    // k went right after its last left turn until it fell off the tree,
+    // undo those right turns and the left one
+    k >>= floor_log2(~k & (k + 1)) + 1;
+    if (k == 0 || codes[k] != code)
+        return npos;
+    return rows[k];
+}
+} // namespace eytzinger
+
+/// Sorted 64 bit key codes in Eytzinger (BFS) order
+/// Node k has its children at 2k and 2k + 1, so the top of the tree shares a
+/// handful of cache lines and a search can prefetch the eight nodes three
+/// levels below it with one cache line. Every code carries the row of its key.
+/// !!Important!! this object does not manage memory.
+/// Nodes are taken from the ArenaAllocator passed to build, the buffer is
+/// reused by later builds while it is large enough.
+class EytzingerIndex final
+{
+    // 1-based, slot 0 is unused
+    uint64_t* codes = nullptr;
+    uint32_t* rows = nullptr;
+    size_t count = 0;
+    size_t capacity = 0;
+
+public:
+    static constexpr uint32_t npos = eytzinger::npos;
+
+    /// Number of keys in the index
+    size_t size() const noexcept
+    {
+        return count;
+    }
+
+    /// Build the index from n keys sorted in the order of encode, and their
+    /// rows
+    template <typename Key, typename Encode>
+    void build(ArenaAllocator& allocator,
+               Key const* keys,
+               uint32_t const* key_rows,
+               size_t const n,
+               Encode const encode)
+    {
+        if (n > capacity)
+        {
+            capacity = std::max(n, 2 * capacity);
+            codes = allocator.allocate<uint64_t>(capacity + 1, CACHE_LINE_SIZE);
+            rows = allocator.allocate<uint32_t>(capacity + 1);
+        }
+        count = n;
+        eytzinger::layout(keys, key_rows, n, encode, codes, rows);
+    }
+
+    /// Row of the key with the given code or npos
+    uint32_t find(uint64_t const code) const noexcept
+    {
+        return eytzinger::find(codes, rows, count, code);
+    }
+
+    /// find for n codes at once, writes their rows to out
+    /// The searches of a group advance one level at a time in turn and each
+    /// prefetches its next node, so their cache misses overlap
+    void find_many(uint64_t const* targets, size_t const n, uint32_t* out) const noexcept
+    {
+        size_t k[GROUP];
+        for (size_t first = 0; first < n; first += GROUP)
+        {
+            size_t const m = std::min(n - first, size_t(GROUP));
+            for (size_t i = 0; i < m; ++i)
+                k[i] = 1;
+            for (bool more = count != 0; more;)
+            {
+                more = false;
+                for (size_t i = 0; i < m; ++i)
+                {
+                    if (k[i] > count)
+                        continue;
+                    k[i] = 2 * k[i] + (codes[k[i]] < targets[first + i]);
+                    ARENA_PREFETCH(codes + k[i]);
+                    more |= k[i] <= count;
+                }
+            }
+            for (size_t i = 0; i < m; ++i)
+            {
+                size_t const found = k[i] >> (floor_log2(~k[i] & (k[i] + 1)) + 1);
+                bool const hit = found != 0 && codes[found] == targets[first + i];
+                out[first + i] = hit ? rows[found] : eytzinger::npos;
+            }
+        }
+    }
+
+    void clear() noexcept
+    {
+        count = 0;
+    }
+
+    // searches find_many runs side by side
+    static constexpr size_t GROUP = 16;
+};
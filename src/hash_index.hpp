@@ -0,0 +1,183 @@
+#pragma once
+#include "arena.hpp"
+#include "cpu.hpp"
+#include "key_traits.hpp"
+#include "point.hpp"
+#include <cstdint>
+#include <utility>
+
+/// Open addressing hash index mapping keys to row indices
+/// Uses Robin Hood probing: an inserted key steals the slot of any resident
+/// that is closer to its home slot, which keeps probe sequences short and lets
+/// lookups for missing keys stop early.
+/// !!Important!! this object does not manage memory.
+/// Slots are taken from the ArenaAllocator passed to insert/reserve, growing
+/// leaves the old table in the arena until it is cleared.
+template <typename Key>
+class HashIndex final
+{
+    struct Slot
+    {
+        Key key;
+        uint32_t row;
+        // Distance from the home slot + 1, 0 marks an empty slot
+        uint32_t dist;
+    };
+
+    Slot* slots = nullptr;
+    size_t mask = 0;
+    size_t count = 0;
+    size_t max_count = 0;
+
+public:
+    static constexpr uint32_t npos = uint32_t(-1);
+
+    bool enabled() const noexcept
+    {
+        return slots != nullptr;
+    }
+
+    size_t size() const noexcept
+    {
+        return count;
+    }
+
+    /// Make room for at least n keys without growing
+    void reserve(ArenaAllocator& allocator, size_t const n)
+    {
+        if (n <= max_count && enabled())
+            return;
+        // keep the load factor at or below 0.8
+        size_t capacity = 16;
+        while (capacity * 4 < n * 5)
+            capacity <<= 1;
+
+        Slot* const old = slots;
+        size_t const old_capacity = enabled() ? mask + 1 : 0;
+
+        slots = allocator.allocate<Slot>(capacity);
+        for (size_t i = 0; i < capacity; ++i)
+            slots[i].dist = 0;
+        mask = capacity - 1;
+        max_count = capacity * 4 / 5;
+        count = 0;
+
+        for (size_t i = 0; i < old_capacity; ++i)
+        {
+            if (old[i].dist != 0)
+                insert_unchecked(old[i].key, old[i].row);
+        }
+    }
+
+    // Inserting the same key twice is UB!
+    void insert(ArenaAllocator& allocator, Key const key, uint32_t const row)
+    {
+        if (count >= max_count)
+            reserve(allocator, 2 * count + 1);
+        insert_unchecked(key, row);
+    }
+
+    /// Returns npos if key is not in the index
+    uint32_t find(Key const key) const noexcept
+    {
+        if (!enabled())
+            return npos;
+        size_t i = home(key);
+        for (uint32_t dist = 1;; ++dist, i = (i + 1) & mask)
+        {
+            Slot const& slot = slots[i];
+            // Robin Hood invariant: the key would have displaced this resident
+            if (slot.dist < dist)
+                return npos;
+            if (slot.key == key)
+                return slot.row;
+        }
+    }
+
+    /// Remove key, returns false if it is not in the index
+    /// The residents after it are shifted back one slot until one is at its
+    /// home slot, so no tombstones are left behind and probes stay short
+    bool erase(Key const key) noexcept
+    {
+        if (!enabled())
+            return false;
+        size_t i = home(key);
+        for (uint32_t dist = 1;; ++dist, i = (i + 1) & mask)
+        {
+            Slot const& slot = slots[i];
+            if (slot.dist < dist)
+                return false;
+            if (slot.key == key)
+                break;
+        }
+        for (size_t next = (i + 1) & mask; slots[next].dist > 1; next = (next + 1) & mask)
+        {
+            slots[i] = slots[next];
+            --slots[i].dist;
+            i = next;
+        }
+        slots[i].dist = 0;
+        --count;
+        return true;
+    }
+
+    /// Start loading the home slot of key into the cache
+    void prefetch(Key const key) const noexcept
+    {
+        if (enabled())
+            ARENA_PREFETCH(slots + home(key));
+    }
+
+    /// Forget all keys but keep the table
+    void clear() noexcept
+    {
+        if (!enabled())
+            return;
+        for (size_t i = 0; i <= mask; ++i)
+            slots[i].dist = 0;
+        count = 0;
+    }
+
+    /// Drop the table, the index is disabled afterwards
+    void reset() noexcept
+    {
+        slots = nullptr;
+        mask = 0;
+        count = 0;
+        max_count = 0;
+    }
+
+private:
+    size_t home(Key const key) const noexcept
+    {
+        // high bits of the hash are the best mixed
+        return size_t(KeyTraits<Key>::hash(key) >> 32) & mask;
+    }
+
+    void insert_unchecked(Key key, uint32_t row) noexcept
+    {
+        using std::swap;
+        size_t i = home(key);
+        uint32_t dist = 1;
+        for (;; ++dist, i = (i + 1) & mask)
+        {
+            Slot& slot = slots[i];
+            if (slot.dist == 0)
+            {
+                slot.key = key;
+                slot.row = row;
+                slot.dist = dist;
+                ++count;
+                return;
+            }
+            if (slot.dist < dist)
+            {
+                swap(slot.key, key);
+                swap(slot.row, row);
+                swap(slot.dist, dist);
+            }
+        }
+    }
+};
+
+using PointHashIndex = HashIndex<Point>;
@@ -0,0 +1,49 @@
+#pragma once
+#include "point.hpp"
+#include <cstdint>
+
+/// What BasicArenaDb needs to know about its key type
+/// Keys are trivially copyable and ordered by operator<.
+/// hash spreads a key over 64 bits for the hash index and the Bloom filter.
+/// Keys with codes map to 64 bit codes that order like operator< and back,
+/// the radix sort, the Eytzinger layout and the branchless search work on
+/// those. Keys without them are only compared.
+/// Spatial keys are 2D points, they also have a Morton order, rectangle
+/// queries and nearest neighbour search.
+template <typename Key>
+struct KeyTraits;
+
+template <>
+struct KeyTraits<Point>
+{
+    static constexpr bool has_codes = true;
+    static constexpr bool spatial = true;
+
+    static uint64_t hash(Point const p) noexcept
+    {
+        return hash_point(p);
+    }
+
+    static uint64_t code(Point const p) noexcept
+    {
+        return lexicographic_code(p);
+    }
+
+    static Point from_code(uint64_t const code) noexcept
+    {
+        return from_lexicographic_code(code);
+    }
+};
+
+/// 96 bits do not fit a code, 3D keys are searched by comparison
+template <>
+struct KeyTraits<Point3>
+{
+    static constexpr bool has_codes = false;
+    static constexpr bool spatial = false;
+
+    static uint64_t hash(Point3 const p) noexcept
+    {
+        return hash_point3(p);
+    }
+};
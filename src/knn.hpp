@@ -0,0 +1,170 @@
+#pragma once
+#include "arena.hpp"
+#include "point.hpp"
+#include <algorithm>
+#include <cstdint>
+
+/// Squared euclidean distance
+/// Computed in double, int64 would overflow for coordinates far apart
+inline double distance2(Point const a, Point const b) noexcept
+{
+    double const dx = double(a.x) - double(b.x);
+    double const dy = double(a.y) - double(b.y);
+    return dx * dx + dy * dy;
+}
+
+struct KnnCandidate
+{
+    double distance2;
+    Point key;
+    uint32_t row;
+
+    bool operator<(KnnCandidate const& c) const noexcept
+    {
+        return distance2 < c.distance2;
+    }
+};
+
+/// Bounded max-heap of the k best candidates seen so far
+/// heap must have room for k entries, returns the new number of entries
+inline size_t offer_candidate(KnnCandidate* heap,
+                              size_t found,
+                              size_t const k,
+                              KnnCandidate const& c)
+{
+    if (found < k)
+    {
+        heap[found++] = c;
+        std::push_heap(heap, heap + found);
+    }
+    else if (c.distance2 < heap[0].distance2)
+    {
+        std::pop_heap(heap, heap + found);
+        heap[found - 1] = c;
+        std::push_heap(heap, heap + found);
+    }
+    return found;
+}
+
+/// Implicit 2-d tree
+/// Nodes are stored in one array, the node of the range [lo, hi) sits at
+/// lo + (hi - lo) / 2 and splits its range on x at even depths and on y at odd
+/// depths. No child pointers are needed.
+/// !!Important!! this object does not manage memory.
+/// Nodes are taken from the ArenaAllocator passed to build, the buffer is
+/// reused by later builds while it is large enough.
+class KdTree final
+{
+    struct Node
+    {
+        Point key;
+        uint32_t row;
+    };
+
+    Node* nodes = nullptr;
+    size_t count = 0;
+    size_t capacity = 0;
+    bool on = false;
+
+public:
+    bool enabled() const noexcept
+    {
+        return on;
+    }
+
+    void enable() noexcept
+    {
+        on = true;
+    }
+
+    /// Number of keys in the tree
+    size_t size() const noexcept
+    {
+        return count;
+    }
+
+    /// Forget all keys but keep the nodes, the tree stays enabled
+    void clear() noexcept
+    {
+        count = 0;
+    }
+
+    /// Build the tree from n keys and their rows
+    void build(ArenaAllocator& allocator, Point const* keys, uint32_t const* rows, size_t const n)
+    {
+        if (n > capacity)
+        {
+            capacity = std::max(n, 2 * capacity);
+            nodes = allocator.allocate<Node>(capacity);
+        }
+        for (size_t i = 0; i < n; ++i)
+            nodes[i] = Node{keys[i], rows[i]};
+        count = n;
+        build_impl(0, n, 0);
+    }
+
+    /// Offer every key of the tree that can beat the current k best to the
+    /// candidate heap, see offer_candidate
+    size_t nearest(Point const q, size_t const k, KnnCandidate* heap, size_t found) const
+    {
+        if (k == 0)
+            return found;
+        return nearest_impl(q, k, heap, found, 0, count, 0);
+    }
+
+private:
+    void build_impl(size_t const lo, size_t const hi, unsigned const depth)
+    {
+        if (hi - lo < 2)
+            return;
+        size_t const mid = lo + (hi - lo) / 2;
+        if (depth & 1)
+        {
+            std::nth_element(nodes + lo, nodes + mid, nodes + hi, [](Node const& a, Node const& b) {
+                return a.key.y < b.key.y;
+            });
+        }
+        else
+        {
+            std::nth_element(nodes + lo, nodes + mid, nodes + hi, [](Node const& a, Node const& b) {
+                return a.key.x < b.key.x;
+            });
+        }
+        build_impl(lo, mid, depth + 1);
+        build_impl(mid + 1, hi, depth + 1);
+    }
+
+    size_t nearest_impl(Point const q,
+                        size_t const k,
+                        KnnCandidate* heap,
+                        size_t found,
+                        size_t const lo,
+                        size_t const hi,
+                        unsigned const depth) const
+    {
+        if (lo >= hi)
+            return found;
+        size_t const mid = lo + (hi - lo) / 2;
+        Node const& node = nodes[mid];
+        KnnCandidate const c{distance2(q, node.key), node.key, node.row};
+        found = offer_candidate(heap, found, k, c);
+
+        double const delta = (depth & 1) ? double(q.y) - double(node.key.y)
+                                         : double(q.x) - double(node.key.x);
+        // descend into the side of the query first, the other side only if
+        // the splitting line is closer than the current k-th best
+        if (delta < 0)
+        {
+            found = nearest_impl(q, k, heap, found, lo, mid, depth + 1);
+            if (found < k || delta * delta < heap[0].distance2)
+                found = nearest_impl(q, k, heap, found, mid + 1, hi, depth + 1);
+        }
+        else
+        {
+            found = nearest_impl(q, k, heap, found, mid + 1, hi, depth + 1);
+            if (found < k || delta * delta < heap[0].distance2)
+                found = nearest_impl(q, k, heap, found, lo, mid, depth + 1);
+        }
+        return found;
+    }
+};
@@ -2,16 +2,29 @@
 
 #include <iostream>
 
+#include <algorithm>
+#include <cassert>
 #include <random>
+#include <set>
+#include <thread>
 
 #ifndef WIN32
 #include <cmath>
 #include <cstdlib>
 #endif
 
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
 #include "arena.hpp"
+#include "bulk_load.hpp"
+#include "codec.hpp"
 #include "db.hpp"
 #include "point.hpp"
+#include "pool.hpp"
+#include "sharded.hpp"
+#include "snapshot.hpp"
 
 CELERO_MAIN
 
@@ -101,6 +114,25 @@ BENCHMARK_F(Init, ArenaSorted, ArenaFixture, 0, 256)
     celero::DoNotOptimizeAway(db);
 }
 
+// Starts from a tiny capacity hint and grows while inserting
+BENCHMARK_F(Init, ArenaGrowing, ArenaFixture, 0, 256)
+{
+    ArenaDb db{16, num_values};
+
+    for (int i = 0; i < num_keys; ++i)
+    {
+        auto p = Point{rand(), rand()};
+        auto* data = db.insert(p);
+        celero::DoNotOptimizeAway(db);
+        for (int j = 0; j < num_values; ++j)
+        {
+            data->push_back(rand());
+        }
+        celero::DoNotOptimizeAway(data);
+    }
+    celero::DoNotOptimizeAway(db);
+}
+
 struct NaiveMapFindFixture : public celero::TestFixture
 {
     std::vector<Point> keys;
@@ -116,6 +148,7 @@ struct NaiveMapFindFixture : public celero::TestFixture
     virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
     {
         num_keys = experimentValue.Value;
+        keys.clear();
         db.clear();
         for (int i = 0; i < num_keys; ++i)
         {
@@ -147,6 +180,7 @@ struct ArenaMapFindFixture : public celero::TestFixture
     virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
     {
         num_keys = experimentValue.Value;
+        keys.clear();
         db.reset(new ArenaDb{num_keys, num_values});
         for (int i = 0; i < num_keys; ++i)
         {
@@ -161,6 +195,15 @@ struct ArenaMapFindFixture : public celero::TestFixture
     }
 };
 
+struct ArenaMapHashedFindFixture : public ArenaMapFindFixture
+{
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        ArenaMapFindFixture::setUp(experimentValue);
+        db->enable_hash_index();
+    }
+};
+
 BASELINE_F(Find, NaiveMap, NaiveMapFindFixture, 0, 256)
 {
     for (auto const& k : keys)
@@ -189,6 +232,15 @@ BENCHMARK_F(Find, ArenaSorted, ArenaMapFindFixture, 0, 256)
     }
 }
 
+BENCHMARK_F(Find, ArenaHashed, ArenaMapHashedFindFixture, 0, 256)
+{
+    for (auto const& k : keys)
+    {
+        auto* v = db->get(k);
+        celero::DoNotOptimizeAway(v);
+    }
+}
+
 BASELINE_F(InsertAndFind, NaiveMap, DbFixture, 0, 64)
 {
     NaiveDb db;
@@ -294,6 +346,41 @@ BENCHMARK_F(InsertAndFind, ArenaSorting, DbFixture, 0, 64)
     celero::DoNotOptimizeAway(sum);
 }
 
+BENCHMARK_F(InsertAndFind, ArenaHashed, DbFixture, 0, 64)
+{
+    ArenaDb db{num_keys};
+    db.enable_hash_index();
+
+    auto const insert = [&]() {
+        const auto p = Point{rand(), rand()};
+        auto* v = db.insert(p);
+        for (int j = 0; j < num_values; ++j)
+        {
+            v->push_back(rand());
+        }
+        return p;
+    };
+
+    std::vector<Point> keys;
+    for (int i = 0; i + 1 < num_keys; ++i)
+    {
+        auto key = insert();
+        keys.emplace_back(key);
+    }
+    double sum = 0.0;
+    for (auto& k : keys)
+    {
+        auto* v = db.get(k);
+        for (auto x : *v)
+            sum += x;
+        celero::DoNotOptimizeAway(v);
+    }
+
+    celero::DoNotOptimizeAway(keys);
+    celero::DoNotOptimizeAway(db);
+    celero::DoNotOptimizeAway(sum);
+}
+
 BASELINE_F(InsertAndSumAll, NaiveMap, DbFixture, 0, 64)
 {
     NaiveDb db;
@@ -396,3 +483,2131 @@ BENCHMARK_F(InsertAndSumAll, ArenaSorted, DbFixture, 0, 64)
     celero::DoNotOptimizeAway(sum);
 }
 
+
+BENCHMARK_F(InsertAndSumAll, ArenaScan, DbFixture, 0, 64)
+{
+    ArenaDb db{num_keys};
+
+    auto const insert = [&]() {
+        const auto p = Point{rand(), rand()};
+        auto* v = db.insert(p);
+        for (int j = 0; j < num_values; ++j)
+        {
+            v->push_back(rand());
+        }
+        return p;
+    };
+
+    std::vector<Point> keys;
+    for (int i = 0; i + 1 < num_keys; ++i)
+    {
+        auto key = insert();
+        keys.emplace_back(key);
+    }
+    db.sort();
+
+    double sum = 0.0;
+    db.scan([&](ArenaDb::VecValues const& v) {
+        for (auto x : v)
+            sum += x;
+    });
+
+    celero::DoNotOptimizeAway(sum);
+}
+
+BENCHMARK_F(InsertAndSumAll, ArenaSum, DbFixture, 0, 64)
+{
+    ArenaDb db{num_keys};
+
+    auto const insert = [&]() {
+        const auto p = Point{rand(), rand()};
+        auto* v = db.insert(p);
+        for (int j = 0; j < num_values; ++j)
+        {
+            v->push_back(rand());
+        }
+        return p;
+    };
+
+    std::vector<Point> keys;
+    for (int i = 0; i + 1 < num_keys; ++i)
+    {
+        auto key = insert();
+        keys.emplace_back(key);
+    }
+    db.sort();
+
+    double sum = db.sum();
+
+    celero::DoNotOptimizeAway(sum);
+}
+
+struct ArenaSumFixture : public DbFixture
+{
+    std::unique_ptr<ArenaDb> db;
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        DbFixture::setUp(experimentValue);
+        db.reset(new ArenaDb{num_keys, num_values});
+        for (int i = 0; i < num_keys; ++i)
+        {
+            auto* data = db->insert(Point{rand(), rand()});
+            for (int j = 0; j < num_values; ++j)
+            {
+                data->push_back(rand());
+            }
+        }
+        db->sort();
+    }
+};
+
+BASELINE_F(SumAll, ArenaScan, ArenaSumFixture, 0, 1024)
+{
+    double sum = 0.0;
+    db->scan([&](ArenaDb::VecValues const& v) {
+        for (auto x : v)
+            sum += x;
+    });
+    celero::DoNotOptimizeAway(sum);
+}
+
+BENCHMARK_F(SumAll, ArenaScalar, ArenaSumFixture, 0, 1024)
+{
+    double sum = db->sum(reduce_kernels(SimdLevel::Scalar));
+    celero::DoNotOptimizeAway(sum);
+}
+
+// Falls back to the best supported kernel on CPUs without AVX2/AVX-512
+BENCHMARK_F(SumAll, ArenaAvx2, ArenaSumFixture, 0, 1024)
+{
+    double sum = db->sum(reduce_kernels(SimdLevel::Avx2));
+    celero::DoNotOptimizeAway(sum);
+}
+
+BENCHMARK_F(SumAll, ArenaAvx512, ArenaSumFixture, 0, 1024)
+{
+    double sum = db->sum(reduce_kernels(SimdLevel::Avx512));
+    celero::DoNotOptimizeAway(sum);
+}
+
+BENCHMARK_F(SumAll, ArenaMinMax, ArenaSumFixture, 0, 1024)
+{
+    double lo = db->min();
+    double hi = db->max();
+    celero::DoNotOptimizeAway(lo);
+    celero::DoNotOptimizeAway(hi);
+}
+
+BENCHMARK_F(SumAll, ArenaSumEach, ArenaSumFixture, 0, 1024)
+{
+    std::vector<double> out(num_keys);
+    db->reduce_each(Reduction::Sum, out.data());
+    celero::DoNotOptimizeAway(out);
+}
+
+std::vector<celero::TestFixture::ExperimentValue> appendSortProblemSpace{
+    1 << 12,
+    1 << 14,
+    1 << 16,
+    1 << 18,
+};
+
+constexpr int APPEND_BATCH = 256;
+constexpr int APPEND_ITERATIONS = 64;
+
+struct NaiveMapAppendFixture : public celero::TestFixture
+{
+    NaiveDb db;
+
+    size_t num_keys, num_values = 30;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return appendSortProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        num_keys = experimentValue.Value;
+        db.clear();
+        for (int i = 0; i < num_keys; ++i)
+        {
+            std::vector<double> v(num_values, rand());
+            db.insert(Point{rand(), rand()}, std::move(v));
+        }
+    }
+};
+
+struct ArenaAppendFixture : public celero::TestFixture
+{
+    std::unique_ptr<ArenaDb> db;
+
+    size_t num_keys, num_values = 30;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return appendSortProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        num_keys = experimentValue.Value;
+        db.reset(new ArenaDb{num_keys, num_values});
+        for (int i = 0; i < num_keys; ++i)
+        {
+            auto* data = db->insert(Point{rand(), rand()});
+            for (int j = 0; j < num_values; ++j)
+            {
+                data->push_back(rand());
+            }
+        }
+        db->sort();
+    }
+};
+
+BASELINE_F(AppendSort, NaiveMap, NaiveMapAppendFixture, 0, APPEND_ITERATIONS)
+{
+    for (int i = 0; i < APPEND_BATCH; ++i)
+    {
+        std::vector<double> v(num_values, rand());
+        db.insert(Point{rand(), rand()}, std::move(v));
+    }
+    celero::DoNotOptimizeAway(db);
+}
+
+BENCHMARK_F(AppendSort, Arena, ArenaAppendFixture, 0, APPEND_ITERATIONS)
+{
+    for (int i = 0; i < APPEND_BATCH; ++i)
+    {
+        auto* data = db->insert(Point{rand(), rand()});
+        for (int j = 0; j < num_values; ++j)
+        {
+            data->push_back(rand());
+        }
+    }
+    db->sort();
+    celero::DoNotOptimizeAway(db);
+}
+
+constexpr int WORLD_SIZE = 1 << 12;
+constexpr int WORLD_KEYS = 1 << 16;
+
+std::vector<celero::TestFixture::ExperimentValue> rectProblemSpace{
+    16,
+    128,
+    1024,
+};
+
+/// Tiles scattered over a WORLD_SIZE x WORLD_SIZE map, experiment value is
+/// the side length of the queried rectangle
+struct RectFixture : public celero::TestFixture
+{
+    std::unique_ptr<ArenaDb> db;
+    int side;
+
+    virtual KeyOrder order() const
+    {
+        return KeyOrder::Lexicographic;
+    }
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return rectProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        side = int(experimentValue.Value);
+        db.reset(new ArenaDb{WORLD_KEYS, 4});
+        db->set_key_order(order());
+        std::set<Point> tiles;
+        while (tiles.size() < WORLD_KEYS)
+        {
+            tiles.insert(Point{rand() % WORLD_SIZE, rand() % WORLD_SIZE});
+        }
+        for (auto const& p : tiles)
+        {
+            auto* data = db->insert(p);
+            for (int j = 0; j < 4; ++j)
+            {
+                data->push_back(rand());
+            }
+        }
+        db->sort();
+    }
+};
+
+struct MortonRectFixture : public RectFixture
+{
+    virtual KeyOrder order() const override
+    {
+        return KeyOrder::Morton;
+    }
+};
+
+BASELINE_F(QueryRect, ArenaScan, RectFixture, 0, 256)
+{
+    int const x0 = rand() % WORLD_SIZE;
+    int const y0 = rand() % WORLD_SIZE;
+    int const x1 = x0 + side - 1;
+    int const y1 = y0 + side - 1;
+    double sum = 0.0;
+    for (auto it = db->begin(); it != db->end(); ++it)
+    {
+        if (in_rect(it->first(), x0, y0, x1, y1))
+            sum += it->second()[0];
+    }
+    celero::DoNotOptimizeAway(sum);
+}
+
+BENCHMARK_F(QueryRect, Arena, RectFixture, 0, 256)
+{
+    int const x0 = rand() % WORLD_SIZE;
+    int const y0 = rand() % WORLD_SIZE;
+    double sum = 0.0;
+    auto const visit = [&](Point const&, ArenaDb::VecValues const& v) { sum += v[0]; };
+    db->query_rect(x0, y0, x0 + side - 1, y0 + side - 1, visit);
+    celero::DoNotOptimizeAway(sum);
+}
+
+BENCHMARK_F(QueryRect, ArenaMorton, MortonRectFixture, 0, 256)
+{
+    int const x0 = rand() % WORLD_SIZE;
+    int const y0 = rand() % WORLD_SIZE;
+    double sum = 0.0;
+    auto const visit = [&](Point const&, ArenaDb::VecValues const& v) { sum += v[0]; };
+    db->query_rect(x0, y0, x0 + side - 1, y0 + side - 1, visit);
+    celero::DoNotOptimizeAway(sum);
+}
+
+std::vector<celero::TestFixture::ExperimentValue> knnProblemSpace{
+    1000,
+    10000,
+    100000,
+    1000000,
+};
+
+constexpr size_t KNN_K = 8;
+constexpr size_t KNN_QUERIES = 64;
+
+struct KnnFixture : public celero::TestFixture
+{
+    std::unique_ptr<ArenaDb> db;
+    std::vector<Point> queries;
+    std::vector<ArenaDb::Neighbour> out;
+    std::vector<size_t> counts;
+
+    size_t num_keys, num_values = 4;
+
+    virtual bool indexed() const
+    {
+        return true;
+    }
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return knnProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        num_keys = experimentValue.Value;
+        db.reset(new ArenaDb{num_keys, num_values});
+        for (int i = 0; i < num_keys; ++i)
+        {
+            auto* data = db->insert(Point{rand(), rand()});
+            for (int j = 0; j < num_values; ++j)
+            {
+                data->push_back(rand());
+            }
+        }
+        if (indexed())
+            db->enable_knn_index();
+        db->sort();
+        queries.clear();
+        for (int i = 0; i < KNN_QUERIES; ++i)
+        {
+            queries.emplace_back(Point{rand(), rand()});
+        }
+        out.resize(KNN_QUERIES * KNN_K);
+        counts.resize(KNN_QUERIES);
+    }
+};
+
+struct BruteForceKnnFixture : public KnnFixture
+{
+    virtual bool indexed() const override
+    {
+        return false;
+    }
+};
+
+BASELINE_F(Knn, BruteForce, BruteForceKnnFixture, 0, 8)
+{
+    for (size_t i = 0; i < KNN_QUERIES; ++i)
+    {
+        counts[i] = db->nearest(queries[i], KNN_K, out.data() + i * KNN_K);
+    }
+    celero::DoNotOptimizeAway(out);
+}
+
+BENCHMARK_F(Knn, KdTree, KnnFixture, 0, 8)
+{
+    for (size_t i = 0; i < KNN_QUERIES; ++i)
+    {
+        counts[i] = db->nearest(queries[i], KNN_K, out.data() + i * KNN_K);
+    }
+    celero::DoNotOptimizeAway(out);
+}
+
+BENCHMARK_F(Knn, KdTreeBatch, KnnFixture, 0, 8)
+{
+    db->nearest_many(queries.data(), KNN_QUERIES, KNN_K, out.data(), counts.data());
+    celero::DoNotOptimizeAway(out);
+}
+
+std::vector<celero::TestFixture::ExperimentValue> allocProblemSpace{
+    1 << 10,
+    1 << 14,
+    1 << 18,
+};
+
+/// Experiment value is the number of allocations, sizes cycle through
+/// 8..512 bytes
+struct AllocFixture : public celero::TestFixture
+{
+    size_t num_allocs;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return allocProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        num_allocs = experimentValue.Value;
+    }
+
+    static size_t alloc_size(size_t i)
+    {
+        return 1 + (i * 7) % 64;
+    }
+
+    void run(GrowthPolicy const policy)
+    {
+        ArenaAllocator arena{DEFAULT_PAGE_SIZE, policy};
+        for (size_t i = 0; i < num_allocs; ++i)
+        {
+            auto* p = arena.allocate<double>(alloc_size(i));
+            celero::DoNotOptimizeAway(p);
+        }
+    }
+};
+
+BASELINE_F(ArenaAlloc, New, AllocFixture, 0, 16)
+{
+    std::vector<double*> ptrs(num_allocs);
+    for (size_t i = 0; i < num_allocs; ++i)
+    {
+        ptrs[i] = new double[alloc_size(i)];
+        celero::DoNotOptimizeAway(ptrs[i]);
+    }
+    for (auto* p : ptrs)
+        delete[] p;
+}
+
+BENCHMARK_F(ArenaAlloc, FixedChunks, AllocFixture, 0, 16)
+{
+    GrowthPolicy policy;
+    policy.factor = 1;
+    run(policy);
+}
+
+BENCHMARK_F(ArenaAlloc, Geometric, AllocFixture, 0, 16)
+{
+    run(GrowthPolicy{});
+}
+
+BENCHMARK_F(ArenaAlloc, GeometricReuse, AllocFixture, 0, 16)
+{
+    GrowthPolicy policy;
+    policy.reuse_older_chunks = true;
+    run(policy);
+}
+
+std::vector<celero::TestFixture::ExperimentValue> chunkSourceProblemSpace{
+    1 << 16,
+    1 << 20,
+};
+
+/// Large sorted database whose arena takes its chunks from Source
+/// Keys are looked up in random order so most lookups miss the TLB
+template <ChunkSource Source>
+struct ChunkSourceFixture : public celero::TestFixture
+{
+    std::unique_ptr<ArenaDb> db;
+    std::vector<Point> keys;
+
+    size_t num_keys, num_values = 30;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return chunkSourceProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        num_keys = experimentValue.Value;
+        keys.clear();
+        db.reset(new ArenaDb{num_keys, num_values, Source});
+        for (int i = 0; i < num_keys; ++i)
+        {
+            auto p = Point{rand(), rand()};
+            keys.emplace_back(p);
+            auto* data = db->insert(p);
+            for (int j = 0; j < num_values; ++j)
+            {
+                data->push_back(rand());
+            }
+        }
+        db->sort();
+        std::shuffle(keys.begin(), keys.end(), std::mt19937{42});
+    }
+
+    virtual void tearDown() override
+    {
+        db.reset();
+    }
+
+    void find()
+    {
+        for (auto const& k : keys)
+        {
+            auto* v = db->get(k);
+            celero::DoNotOptimizeAway(v);
+        }
+    }
+};
+
+using HeapChunkFixture = ChunkSourceFixture<ChunkSource::Heap>;
+using MmapChunkFixture = ChunkSourceFixture<ChunkSource::Mmap>;
+using PopulateChunkFixture = ChunkSourceFixture<ChunkSource::MmapPopulate>;
+using ThpChunkFixture = ChunkSourceFixture<ChunkSource::TransparentHugePages>;
+using HugePageChunkFixture = ChunkSourceFixture<ChunkSource::HugePages>;
+
+BASELINE_F(ChunkSourceFind, Heap, HeapChunkFixture, 0, 4)
+{
+    find();
+}
+
+BENCHMARK_F(ChunkSourceFind, Mmap, MmapChunkFixture, 0, 4)
+{
+    find();
+}
+
+BENCHMARK_F(ChunkSourceFind, MmapPopulate, PopulateChunkFixture, 0, 4)
+{
+    find();
+}
+
+BENCHMARK_F(ChunkSourceFind, TransparentHugePages, ThpChunkFixture, 0, 4)
+{
+    find();
+}
+
+// Behaves like TransparentHugePages unless huge pages are reserved, see
+// /proc/sys/vm/nr_hugepages
+BENCHMARK_F(ChunkSourceFind, HugePages, HugePageChunkFixture, 0, 4)
+{
+    find();
+}
+
+BASELINE_F(ChunkSourceSum, Heap, HeapChunkFixture, 0, 16)
+{
+    double sum = db->sum();
+    celero::DoNotOptimizeAway(sum);
+}
+
+BENCHMARK_F(ChunkSourceSum, Mmap, MmapChunkFixture, 0, 16)
+{
+    double sum = db->sum();
+    celero::DoNotOptimizeAway(sum);
+}
+
+BENCHMARK_F(ChunkSourceSum, MmapPopulate, PopulateChunkFixture, 0, 16)
+{
+    double sum = db->sum();
+    celero::DoNotOptimizeAway(sum);
+}
+
+BENCHMARK_F(ChunkSourceSum, TransparentHugePages, ThpChunkFixture, 0, 16)
+{
+    double sum = db->sum();
+    celero::DoNotOptimizeAway(sum);
+}
+
+BENCHMARK_F(ChunkSourceSum, HugePages, HugePageChunkFixture, 0, 16)
+{
+    double sum = db->sum();
+    celero::DoNotOptimizeAway(sum);
+}
+
+/// Experiment value is the number of threads, powers of two up to
+/// hardware_concurrency
+std::vector<celero::TestFixture::ExperimentValue> threadProblemSpace()
+{
+    std::vector<celero::TestFixture::ExperimentValue> space;
+    size_t const hardware = std::max(std::thread::hardware_concurrency(), 1u);
+    for (size_t t = 1; t < hardware; t *= 2)
+        space.push_back(int64_t(t));
+    space.push_back(int64_t(hardware));
+    return space;
+}
+
+constexpr size_t SHARDED_KEYS = 1 << 16;
+// operations per thread
+constexpr size_t SHARDED_OPS = 1 << 14;
+
+/// ShardedArenaDb with Shards shards prefilled with SHARDED_KEYS keys
+/// One shard is the same as a single ArenaDb behind a global lock
+template <size_t Shards>
+struct ShardedFixture : public celero::TestFixture
+{
+    std::unique_ptr<ShardedArenaDb> db;
+    std::vector<Point> keys;
+    // keeps the keys inserted by different runs apart
+    int round = 0;
+
+    size_t num_threads, num_values = 30;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return threadProblemSpace();
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        num_threads = experimentValue.Value;
+        keys.clear();
+        round = 0;
+        db.reset(new ShardedArenaDb{Shards, SHARDED_KEYS, num_values});
+        for (size_t i = 0; i < SHARDED_KEYS; ++i)
+        {
+            auto p = Point{rand(), rand()};
+            keys.emplace_back(p);
+            db->insert(p, [&](ShardedArenaDb::VecValues& v) {
+                for (int j = 0; j < num_values; ++j)
+                    v.push_back(rand());
+            });
+        }
+    }
+
+    virtual void tearDown() override
+    {
+        db.reset();
+    }
+
+    /// Every thread runs SHARDED_OPS operations, read_percent of them look up
+    /// existing keys and the rest insert new ones
+    void run(unsigned const read_percent)
+    {
+        ++round;
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_threads; ++t)
+        {
+            threads.emplace_back([this, t, read_percent] {
+                std::mt19937 rng{uint32_t(round * num_threads + t)};
+                // rand() never returns negative numbers, so y < 0 never
+                // collides with the prefilled keys
+                int const y = -int(round * num_threads + t + 1);
+                double sum = 0.0;
+                for (size_t i = 0; i < SHARDED_OPS; ++i)
+                {
+                    if (rng() % 100 < read_percent)
+                    {
+                        db->get(keys[rng() % keys.size()],
+                                [&](ShardedArenaDb::VecValues const& v) { sum += v[0]; });
+                    }
+                    else
+                    {
+                        db->insert(Point{int(i), y}, [&](ShardedArenaDb::VecValues& v) {
+                            for (int j = 0; j < num_values; ++j)
+                                v.push_back(j);
+                        });
+                    }
+                }
+                celero::DoNotOptimizeAway(sum);
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+    }
+};
+
+using GlobalLockFixture = ShardedFixture<1>;
+using ShardedArenaFixture = ShardedFixture<64>;
+
+BASELINE_F(ShardedRead90, GlobalLock, GlobalLockFixture, 0, 4)
+{
+    run(90);
+}
+
+BENCHMARK_F(ShardedRead90, Sharded, ShardedArenaFixture, 0, 4)
+{
+    run(90);
+}
+
+BASELINE_F(ShardedMixed, GlobalLock, GlobalLockFixture, 0, 4)
+{
+    run(50);
+}
+
+BENCHMARK_F(ShardedMixed, Sharded, ShardedArenaFixture, 0, 4)
+{
+    run(50);
+}
+
+BASELINE_F(ShardedWrite90, GlobalLock, GlobalLockFixture, 0, 4)
+{
+    run(10);
+}
+
+BENCHMARK_F(ShardedWrite90, Sharded, ShardedArenaFixture, 0, 4)
+{
+    run(10);
+}
+
+BENCHMARK_F(ShardedWrite90, ShardedSortAndSum, ShardedArenaFixture, 0, 4)
+{
+    run(10);
+    db->sort();
+    double sum = db->sum();
+    celero::DoNotOptimizeAway(sum);
+}
+
+std::vector<celero::TestFixture::ExperimentValue> parallelSortProblemSpace{
+    100000,
+    1000000,
+    10000000,
+};
+
+/// Experiment value is the number of keys
+/// Every run reloads the keys in random order and sorts them, rows hold a
+/// single value to keep the 10^7 key runs in memory
+struct ParallelSortFixture : public celero::TestFixture
+{
+    std::unique_ptr<ArenaDb> db;
+    std::vector<Point> keys;
+
+    size_t num_keys;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return parallelSortProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        num_keys = experimentValue.Value;
+        keys.clear();
+        std::set<Point> unique;
+        while (unique.size() < num_keys)
+            unique.insert(Point{rand(), rand()});
+        keys.assign(unique.begin(), unique.end());
+        std::shuffle(keys.begin(), keys.end(), std::mt19937{42});
+        db.reset(new ArenaDb{num_keys, 1});
+    }
+
+    virtual void tearDown() override
+    {
+        db.reset();
+    }
+
+    void run(SortOptions const& options)
+    {
+        db->clear();
+        for (auto const& k : keys)
+            db->insert(k)->push_back(k.x);
+        db->sort(options);
+    }
+
+    void run(unsigned const threads)
+    {
+        SortOptions options;
+        options.threads = threads;
+        run(options);
+    }
+};
+
+BASELINE_F(ParallelSort, Sequential, ParallelSortFixture, 0, 4)
+{
+    run(1);
+}
+
+BENCHMARK_F(ParallelSort, Threads2, ParallelSortFixture, 0, 4)
+{
+    run(2);
+}
+
+BENCHMARK_F(ParallelSort, Threads4, ParallelSortFixture, 0, 4)
+{
+    run(4);
+}
+
+BENCHMARK_F(ParallelSort, AllThreads, ParallelSortFixture, 0, 4)
+{
+    run(0);
+}
+
+struct MortonSortFixture : public ParallelSortFixture
+{
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        ParallelSortFixture::setUp(experimentValue);
+        db->set_key_order(KeyOrder::Morton);
+    }
+};
+
+BASELINE_F(RadixSort, Quicksort, ParallelSortFixture, 0, 4)
+{
+    run(SortOptions{});
+}
+
+BENCHMARK_F(RadixSort, Radix, ParallelSortFixture, 0, 4)
+{
+    SortOptions options;
+    options.algorithm = SortAlgorithm::Radix;
+    run(options);
+}
+
+BENCHMARK_F(RadixSort, QuicksortMorton, MortonSortFixture, 0, 4)
+{
+    run(SortOptions{});
+}
+
+BENCHMARK_F(RadixSort, RadixMorton, MortonSortFixture, 0, 4)
+{
+    SortOptions options;
+    options.algorithm = SortAlgorithm::Radix;
+    run(options);
+}
+
+constexpr size_t SEARCH_LOOKUPS = 1 << 16;
+
+/// Sorted database with parallelSortProblemSpace keys searched with Layout
+/// Lookups hit existing keys in random order
+template <SearchLayout Layout>
+struct SearchLayoutFixture : public celero::TestFixture
+{
+    std::unique_ptr<ArenaDb> db;
+    std::vector<Point> lookups;
+    std::vector<Point> sorted_lookups;
+    std::vector<ArenaDb::VecValues const*> out;
+
+    size_t num_keys;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return parallelSortProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        num_keys = experimentValue.Value;
+        lookups.clear();
+        db.reset(new ArenaDb{num_keys, 1});
+        std::mt19937 rng{42};
+        std::set<Point> unique;
+        while (unique.size() < num_keys)
+        {
+            auto p = Point{int(rng() >> 1), int(rng() >> 1)};
+            if (unique.insert(p).second)
+                db->insert(p)->push_back(p.x);
+        }
+        SortOptions options;
+        options.algorithm = SortAlgorithm::Radix;
+        db->sort(options);
+        db->set_search_layout(Layout);
+
+        std::vector<Point> keys(unique.begin(), unique.end());
+        for (size_t i = 0; i < SEARCH_LOOKUPS; ++i)
+            lookups.push_back(keys[rng() % keys.size()]);
+        sorted_lookups = lookups;
+        std::sort(sorted_lookups.begin(), sorted_lookups.end());
+        out.resize(SEARCH_LOOKUPS);
+    }
+
+    virtual void tearDown() override
+    {
+        db.reset();
+    }
+
+    void find()
+    {
+        for (auto const& k : lookups)
+        {
+            auto* v = db->get(k);
+            celero::DoNotOptimizeAway(v);
+        }
+    }
+
+    void get_many(std::vector<Point> const& batch)
+    {
+        db->get_many(batch.data(), batch.size(), out.data());
+        celero::DoNotOptimizeAway(out);
+    }
+};
+
+using LowerBoundFixture = SearchLayoutFixture<SearchLayout::LowerBound>;
+using BranchlessFixture = SearchLayoutFixture<SearchLayout::Branchless>;
+using EytzingerFixture = SearchLayoutFixture<SearchLayout::Eytzinger>;
+
+BASELINE_F(SearchLayout, LowerBound, LowerBoundFixture, 0, 16)
+{
+    find();
+}
+
+BENCHMARK_F(SearchLayout, Branchless, BranchlessFixture, 0, 16)
+{
+    find();
+}
+
+BENCHMARK_F(SearchLayout, Eytzinger, EytzingerFixture, 0, 16)
+{
+    find();
+}
+
+struct HashedSearchFixture : public LowerBoundFixture
+{
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        LowerBoundFixture::setUp(experimentValue);
+        db->enable_hash_index();
+    }
+};
+
+BASELINE_F(GetMany, Get, LowerBoundFixture, 0, 16)
+{
+    find();
+}
+
+BENCHMARK_F(GetMany, Batch, LowerBoundFixture, 0, 16)
+{
+    get_many(lookups);
+}
+
+BENCHMARK_F(GetMany, SortedBatch, LowerBoundFixture, 0, 16)
+{
+    get_many(sorted_lookups);
+}
+
+BENCHMARK_F(GetMany, GetEytzinger, EytzingerFixture, 0, 16)
+{
+    find();
+}
+
+BENCHMARK_F(GetMany, BatchEytzinger, EytzingerFixture, 0, 16)
+{
+    get_many(lookups);
+}
+
+BENCHMARK_F(GetMany, GetHashed, HashedSearchFixture, 0, 16)
+{
+    find();
+}
+
+BENCHMARK_F(GetMany, BatchHashed, HashedSearchFixture, 0, 16)
+{
+    get_many(lookups);
+}
+
+std::vector<celero::TestFixture::ExperimentValue> tailProblemSpace{
+    64,
+    1 << 10,
+    1 << 14,
+};
+
+constexpr size_t TAIL_SORTED_KEYS = 1 << 16;
+constexpr size_t TAIL_LOOKUPS = 1 << 10;
+
+/// Experiment value is the number of keys inserted after the last sort
+/// Every lookup hits one of them, so it scans part of the tail after missing
+/// the sorted prefix
+struct TailScanFixture : public celero::TestFixture
+{
+    std::unique_ptr<ArenaDb> db;
+    std::vector<Point> lookups;
+
+    size_t num_tail;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return tailProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        num_tail = experimentValue.Value;
+        lookups.clear();
+        db.reset(new ArenaDb{TAIL_SORTED_KEYS + num_tail, 1});
+        std::mt19937 rng{42};
+        // even x for the sorted keys, odd x for the tail
+        for (size_t i = 0; i < TAIL_SORTED_KEYS; ++i)
+            db->insert(Point{int(2 * i), int(rng() >> 1)})->push_back(i);
+        db->sort();
+        std::vector<Point> tail;
+        for (size_t i = 0; i < num_tail; ++i)
+        {
+            auto p = Point{int(2 * i + 1), int(rng() >> 1)};
+            tail.push_back(p);
+            db->insert(p)->push_back(i);
+        }
+        for (size_t i = 0; i < TAIL_LOOKUPS; ++i)
+            lookups.push_back(tail[rng() % tail.size()]);
+    }
+
+    void find(SimdLevel const level)
+    {
+        db->set_tail_scan_level(level);
+        for (auto const& k : lookups)
+        {
+            auto* v = db->get(k);
+            celero::DoNotOptimizeAway(v);
+        }
+    }
+};
+
+BASELINE_F(TailScan, Scalar, TailScanFixture, 0, 64)
+{
+    find(SimdLevel::Scalar);
+}
+
+// Falls back to the best supported kernel on CPUs without AVX2/AVX-512
+BENCHMARK_F(TailScan, Avx2, TailScanFixture, 0, 64)
+{
+    find(SimdLevel::Avx2);
+}
+
+BENCHMARK_F(TailScan, Avx512, TailScanFixture, 0, 64)
+{
+    find(SimdLevel::Avx512);
+}
+
+/// Experiment value is the percentage of lookups that hit
+std::vector<celero::TestFixture::ExperimentValue> hitRatioProblemSpace{
+    0,
+    10,
+    50,
+    90,
+};
+
+constexpr size_t BLOOM_SORTED_KEYS = 1 << 18;
+constexpr size_t BLOOM_TAIL_KEYS = 1 << 10;
+constexpr size_t BLOOM_LOOKUPS = 1 << 14;
+
+/// Database with a sorted prefix and an unsorted tail, checked through a
+/// Bloom filter of BitsPerKey bits per key, 0 disables the filter
+template <unsigned BitsPerKey>
+struct BloomFixture : public celero::TestFixture
+{
+    std::unique_ptr<ArenaDb> db;
+    std::vector<Point> lookups;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return hitRatioProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        size_t const hit_percent = experimentValue.Value;
+        lookups.clear();
+        db.reset(new ArenaDb{BLOOM_SORTED_KEYS + BLOOM_TAIL_KEYS, 1});
+        if (BitsPerKey != 0)
+            db->enable_bloom_filter(BitsPerKey);
+        std::mt19937 rng{42};
+        // present keys have even y, absent ones odd y
+        std::vector<Point> keys;
+        for (size_t i = 0; i < BLOOM_SORTED_KEYS + BLOOM_TAIL_KEYS; ++i)
+        {
+            if (i == BLOOM_SORTED_KEYS)
+                db->sort();
+            auto p = Point{int(i), int(rng() >> 1) & ~1};
+            keys.push_back(p);
+            db->insert(p)->push_back(i);
+        }
+        for (size_t i = 0; i < BLOOM_LOOKUPS; ++i)
+        {
+            auto p = keys[rng() % keys.size()];
+            if (rng() % 100 >= hit_percent)
+                p.y |= 1;
+            lookups.push_back(p);
+        }
+    }
+
+    virtual void tearDown() override
+    {
+        db.reset();
+    }
+
+    void find()
+    {
+        for (auto const& k : lookups)
+        {
+            auto* v = db->get(k);
+            celero::DoNotOptimizeAway(v);
+        }
+    }
+};
+
+using NoBloomFixture = BloomFixture<0>;
+using Bloom10Fixture = BloomFixture<10>;
+using Bloom16Fixture = BloomFixture<16>;
+
+BASELINE_F(BloomFind, NoFilter, NoBloomFixture, 0, 16)
+{
+    find();
+}
+
+BENCHMARK_F(BloomFind, Bloom10, Bloom10Fixture, 0, 16)
+{
+    find();
+}
+
+BENCHMARK_F(BloomFind, Bloom16, Bloom16Fixture, 0, 16)
+{
+    find();
+}
+
+std::vector<celero::TestFixture::ExperimentValue> snapshotProblemSpace{
+    100000,
+    1000000,
+};
+
+/// Snapshot of a database with snapshotProblemSpace keys of 4 values each
+/// The snapshot file is written in setUp, the benchmarks compare rebuilding
+/// the database from its points with writing and opening the snapshot
+struct SnapshotFixture : public celero::TestFixture
+{
+    static constexpr char const* PATH = "arena_bench.snapshot";
+
+    std::unique_ptr<ArenaDb> db;
+    std::vector<Point> points;
+    Point query;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return snapshotProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        size_t const n = experimentValue.Value;
+        std::mt19937 rng{42};
+        points.clear();
+        db.reset(new ArenaDb{n, 4});
+        for (size_t i = 0; i < n; ++i)
+        {
+            auto p = Point{int(i), int(rng() >> 1)};
+            points.push_back(p);
+            auto* v = db->insert(p);
+            for (int j = 0; j < 4; ++j)
+                v->push_back(j);
+        }
+        std::shuffle(points.begin(), points.end(), rng);
+        query = points[n / 2];
+        write_snapshot(*db, PATH);
+    }
+
+    virtual void tearDown() override
+    {
+        db.reset();
+        std::remove(PATH);
+    }
+
+    /// Ask the kernel to forget the cached pages of the snapshot
+    /// Dirty pages are not dropped, the file is synced first
+    void drop_page_cache()
+    {
+#if ARENA_HAS_MMAP
+        int const fd = ::open(PATH, O_RDONLY);
+        if (fd < 0)
+            return;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+#endif
+    }
+
+    void open_and_query()
+    {
+        ArenaSnapshot snapshot{PATH};
+        auto v = snapshot.get(query);
+        celero::DoNotOptimizeAway(v.first);
+    }
+};
+
+BASELINE_F(Snapshot, Rebuild, SnapshotFixture, 0, 4)
+{
+    ArenaDb rebuilt{points.size(), 4};
+    for (auto const& p : points)
+    {
+        auto* v = rebuilt.insert(p);
+        for (int j = 0; j < 4; ++j)
+            v->push_back(j);
+    }
+    rebuilt.sort();
+    celero::DoNotOptimizeAway(rebuilt.get(query));
+}
+
+BENCHMARK_F(Snapshot, Write, SnapshotFixture, 0, 4)
+{
+    write_snapshot(*db, PATH);
+}
+
+BENCHMARK_F(Snapshot, Open, SnapshotFixture, 0, 4)
+{
+    ArenaSnapshot snapshot{PATH};
+    celero::DoNotOptimizeAway(snapshot.size());
+}
+
+BENCHMARK_F(Snapshot, FirstQueryWarm, SnapshotFixture, 0, 4)
+{
+    open_and_query();
+}
+
+BENCHMARK_F(Snapshot, FirstQueryCold, SnapshotFixture, 0, 4)
+{
+    drop_page_cache();
+    open_and_query();
+}
+
+/// Experiment value is the number of records, 1e8 records are about 3 GB of
+/// CSV
+std::vector<celero::TestFixture::ExperimentValue> bulkLoadProblemSpace{
+    1000000,
+    10000000,
+    100000000,
+};
+
+constexpr size_t BULK_VALUES = 4;
+
+/// CSV and binary files of random records with BULK_VALUES values each,
+/// written in setUp
+struct BulkLoadFixture : public celero::TestFixture
+{
+    static constexpr char const* CSV_PATH = "arena_bench_bulk.csv";
+    static constexpr char const* BINARY_PATH = "arena_bench_bulk.bin";
+
+    size_t records = 0;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return bulkLoadProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        records = experimentValue.Value;
+        std::mt19937 rng{42};
+        std::FILE* csv = std::fopen(CSV_PATH, "wb");
+        std::FILE* binary = std::fopen(BINARY_PATH, "wb");
+        for (size_t i = 0; i < records; ++i)
+        {
+            // y is unique, so every key is, and x scatters them
+            int32_t const key[2] = {int32_t(rng() >> 1), int32_t(i)};
+            uint32_t const count = BULK_VALUES;
+            double values[BULK_VALUES];
+            std::fprintf(csv, "%d,%d", key[0], key[1]);
+            for (size_t j = 0; j < BULK_VALUES; ++j)
+            {
+                values[j] = double(rng() % 100000) / 8;
+                std::fprintf(csv, ",%g", values[j]);
+            }
+            std::fputc('\n', csv);
+            std::fwrite(key, sizeof(key), 1, binary);
+            std::fwrite(&count, sizeof(count), 1, binary);
+            std::fwrite(values, sizeof(values), 1, binary);
+        }
+        std::fclose(csv);
+        std::fclose(binary);
+    }
+
+    virtual void tearDown() override
+    {
+        std::remove(CSV_PATH);
+        std::remove(BINARY_PATH);
+    }
+
+    /// Read the CSV a line at a time, insert and push_back every value
+    void load_rows()
+    {
+        ArenaDb db{records, BULK_VALUES};
+        std::FILE* csv = std::fopen(CSV_PATH, "rb");
+        char line[256];
+        while (std::fgets(line, sizeof(line), csv) != nullptr)
+        {
+            char const* p = line;
+            char const* const end = line + std::strlen(line) - 1;
+            Point key;
+            bulk::parse_int(p, end, key.x);
+            ++p;
+            bulk::parse_int(p, end, key.y);
+            auto* v = db.insert(key);
+            while (p != end)
+            {
+                double d;
+                ++p;
+                bulk::parse_double(p, end, d);
+                v->push_back(d);
+            }
+        }
+        std::fclose(csv);
+        db.sort();
+        celero::DoNotOptimizeAway(db.key_count());
+    }
+
+    void load_bulk(char const* path, RecordFormat const format, unsigned const threads)
+    {
+        ArenaDb db{records, BULK_VALUES};
+        BulkLoadOptions options;
+        options.format = format;
+        options.threads = threads;
+        std::FILE* file = std::fopen(path, "rb");
+        bulk_load_stream(
+            db,
+            [file](char* const buffer, size_t const n) { return std::fread(buffer, 1, n, file); },
+            options);
+        std::fclose(file);
+        celero::DoNotOptimizeAway(db.key_count());
+    }
+
+    /// Load the CSV with a malformed record at its end from memory
+    /// The chunks before it are parsed and sorted when it fails, the load
+    /// must leave the database as empty as it was
+    void load_rejected()
+    {
+        std::string data;
+        std::FILE* file = std::fopen(CSV_PATH, "rb");
+        char buffer[1 << 16];
+        for (size_t n; (n = std::fread(buffer, 1, sizeof(buffer), file)) != 0;)
+            data.append(buffer, n);
+        std::fclose(file);
+        data += "malformed\n";
+
+        ArenaDb db{records, BULK_VALUES};
+        BulkLoadOptions options;
+        options.chunk_size = std::max(data.size() / 8, size_t(1));
+        try
+        {
+            bulk_load(db, data.data(), data.size(), options);
+        }
+        catch (std::runtime_error const&)
+        {
+        }
+        assert(db.key_count() == 0 && db.count() == 0);
+        celero::DoNotOptimizeAway(db.count());
+    }
+};
+
+BASELINE_F(BulkLoad, RowByRow, BulkLoadFixture, 0, 1)
+{
+    load_rows();
+}
+
+BENCHMARK_F(BulkLoad, CsvSingleThread, BulkLoadFixture, 0, 1)
+{
+    load_bulk(CSV_PATH, RecordFormat::Csv, 1);
+}
+
+BENCHMARK_F(BulkLoad, Csv, BulkLoadFixture, 0, 1)
+{
+    load_bulk(CSV_PATH, RecordFormat::Csv, 0);
+}
+
+BENCHMARK_F(BulkLoad, Binary, BulkLoadFixture, 0, 1)
+{
+    load_bulk(BINARY_PATH, RecordFormat::Binary, 0);
+}
+
+BENCHMARK_F(BulkLoad, CsvRejected, BulkLoadFixture, 0, 1)
+{
+    load_rejected();
+}
+
+/// Resident set size of the process in bytes, 0 where it is not known
+size_t resident_bytes()
+{
+    size_t pages = 0;
+#ifdef __linux__
+    std::FILE* statm = std::fopen("/proc/self/statm", "r");
+    if (statm != nullptr)
+    {
+        unsigned long total, resident;
+        if (std::fscanf(statm, "%lu %lu", &total, &resident) == 2)
+            pages = resident;
+        std::fclose(statm);
+    }
+    pages *= size_t(sysconf(_SC_PAGESIZE));
+#endif
+    return pages;
+}
+
+/// A size in MB reported next to the timings
+class MegabytesMeasurement final : public celero::UserDefinedMeasurementTemplate<double>
+{
+    std::string name;
+
+public:
+    explicit MegabytesMeasurement(std::string name) : name(std::move(name))
+    {
+    }
+
+    virtual std::string getName() const override
+    {
+        return name;
+    }
+
+    void addBytes(size_t const bytes)
+    {
+        addValue(double(bytes) / double(1 << 20));
+    }
+};
+
+/// Bytes per value reported next to the timings
+class BytesPerValueMeasurement final : public celero::UserDefinedMeasurementTemplate<double>
+{
+public:
+    virtual std::string getName() const override
+    {
+        return "BytesPerValue";
+    }
+
+    void addBytes(size_t const bytes, size_t const values)
+    {
+        addValue(double(bytes) / double(values));
+    }
+};
+
+std::vector<celero::TestFixture::ExperimentValue> valueMemoryProblemSpace{
+    10000,
+    100000,
+    1000000,
+};
+
+// longest row of the skewed distribution, the fixed layout reserves this for
+// every row
+constexpr size_t SKEWED_MAX_VALUES = 200;
+
+/// Rows of skewed lengths: 90% hold 2-5 values, 9% 6-30 and 1% up to
+/// SKEWED_MAX_VALUES
+/// Reports the memory the database holds (MemoryMB) and how much the resident
+/// set grew while building it (RssMB)
+template <ValueLayout Layout>
+struct ValueMemoryFixture : public celero::TestFixture
+{
+    std::vector<size_t> lengths;
+    std::shared_ptr<MegabytesMeasurement> memory =
+        std::make_shared<MegabytesMeasurement>("MemoryMB");
+    std::shared_ptr<MegabytesMeasurement> rss = std::make_shared<MegabytesMeasurement>("RssMB");
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return valueMemoryProblemSpace;
+    }
+
+    virtual std::vector<std::shared_ptr<celero::UserDefinedMeasurement>>
+    getUserDefinedMeasurements() const override
+    {
+        return {memory, rss};
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        std::mt19937 rng{42};
+        lengths.resize(experimentValue.Value);
+        for (auto& n : lengths)
+        {
+            unsigned const bucket = rng() % 100;
+            if (bucket < 90)
+                n = 2 + rng() % 4;
+            else if (bucket < 99)
+                n = 6 + rng() % 25;
+            else
+                n = 31 + rng() % (SKEWED_MAX_VALUES - 30);
+        }
+    }
+
+    void build()
+    {
+        size_t const before = resident_bytes();
+        ArenaDb db{lengths.size(), Layout == ValueLayout::Fixed ? SKEWED_MAX_VALUES : 4};
+        db.set_value_layout(Layout);
+        for (size_t i = 0; i < lengths.size(); ++i)
+        {
+            auto* v = db.insert(Point{int(i), int(i)}, lengths[i]);
+            for (size_t j = 0; j < lengths[i]; ++j)
+                v->push_back(j);
+        }
+        db.sort();
+        celero::DoNotOptimizeAway(db.sum());
+        memory->addBytes(db.memory_usage());
+        rss->addBytes(resident_bytes() - before);
+    }
+};
+
+using FixedValuesFixture = ValueMemoryFixture<ValueLayout::Fixed>;
+using RaggedValuesFixture = ValueMemoryFixture<ValueLayout::Ragged>;
+
+BASELINE_F(ValueMemory, Fixed, FixedValuesFixture, 0, 1)
+{
+    build();
+}
+
+BENCHMARK_F(ValueMemory, Ragged, RaggedValuesFixture, 0, 1)
+{
+    build();
+}
+
+std::vector<celero::TestFixture::ExperimentValue> keyValueProblemSpace{
+    1 << 12,
+    1 << 16,
+    1 << 20,
+};
+
+constexpr size_t KEY_VALUE_WIDTH = 4;
+constexpr size_t KEY_VALUE_LOOKUPS = 1 << 14;
+
+/// i-th key of a table, random but distinct
+Point make_key(size_t const i, uint32_t const r, Point const*)
+{
+    return Point{int(r >> 1), int(i)};
+}
+
+Point3 make_key(size_t const i, uint32_t const r, Point3 const*)
+{
+    return Point3{int(r >> 16), int(r & 0xffff), int(i)};
+}
+
+/// Db with experimentValue keys of KEY_VALUE_WIDTH values each
+/// A sample looks up KEY_VALUE_LOOKUPS random keys, sums their values and then
+/// sums the whole table
+template <typename Db, typename Key>
+struct KeyValueFixture : public celero::TestFixture
+{
+    std::unique_ptr<Db> db;
+    std::vector<Key> lookups;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return keyValueProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        size_t const n = experimentValue.Value;
+        std::mt19937 rng{42};
+        std::vector<Key> keys;
+        keys.reserve(n);
+        db.reset(new Db{n, KEY_VALUE_WIDTH});
+        for (size_t i = 0; i < n; ++i)
+        {
+            keys.push_back(make_key(i, rng(), static_cast<Key const*>(nullptr)));
+            auto* v = db->insert(keys.back());
+            for (size_t j = 0; j < KEY_VALUE_WIDTH; ++j)
+                v->push_back(rng() % 100);
+        }
+        db->sort();
+        lookups.clear();
+        for (size_t i = 0; i < KEY_VALUE_LOOKUPS; ++i)
+            lookups.push_back(keys[rng() % n]);
+    }
+
+    virtual void tearDown() override
+    {
+        db.reset();
+    }
+
+    void run()
+    {
+        double sum = 0.0;
+        for (auto const& k : lookups)
+        {
+            for (auto const x : *db->get(k))
+                sum += x;
+        }
+        sum += db->sum();
+        celero::DoNotOptimizeAway(sum);
+    }
+};
+
+using PointDoubleFixture = KeyValueFixture<ArenaDb, Point>;
+using PointDoubleInlineFixture = KeyValueFixture<BasicArenaDb<Point, double, 4>, Point>;
+using PointFloatFixture = KeyValueFixture<BasicArenaDb<Point, float>, Point>;
+using PointIntInlineFixture = KeyValueFixture<BasicArenaDb<Point, int32_t, 4>, Point>;
+using Point3DoubleFixture = KeyValueFixture<BasicArenaDb<Point3, double>, Point3>;
+
+BASELINE_F(KeyValue, PointDouble, PointDoubleFixture, 0, 16)
+{
+    run();
+}
+
+BENCHMARK_F(KeyValue, PointDoubleInline, PointDoubleInlineFixture, 0, 16)
+{
+    run();
+}
+
+BENCHMARK_F(KeyValue, PointFloat, PointFloatFixture, 0, 16)
+{
+    run();
+}
+
+BENCHMARK_F(KeyValue, PointIntInline, PointIntInlineFixture, 0, 16)
+{
+    run();
+}
+
+BENCHMARK_F(KeyValue, Point3Double, Point3DoubleFixture, 0, 16)
+{
+    run();
+}
+
+/// Experiment value is the number of rows
+std::vector<celero::TestFixture::ExperimentValue> codecProblemSpace{
+    1 << 10,
+    1 << 13,
+    1 << 16,
+};
+
+// a row is a strip of a height map tile
+constexpr size_t CODEC_ROW = 32;
+// heights are in metres, fixed-point values in centimetres
+constexpr double CODEC_SCALE = 0.01;
+
+template <typename Value>
+Value encode_height(double const h, std::false_type /* integral */)
+{
+    return Value(h);
+}
+
+template <typename Value>
+Value encode_height(double const h, std::true_type /* integral */)
+{
+    return to_fixed<Value>(h, CODEC_SCALE);
+}
+
+/// Rows of CODEC_ROW heights along a random walk, in a table of Value
+/// Integer values are fixed-point with CODEC_SCALE. BytesPerValue counts
+/// everything the table holds, keys included.
+template <typename Value>
+struct CodecFixture : public celero::TestFixture
+{
+    using Db = BasicArenaDb<Point, Value>;
+
+    std::unique_ptr<Db> db;
+    std::shared_ptr<BytesPerValueMeasurement> bytes = std::make_shared<BytesPerValueMeasurement>();
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return codecProblemSpace;
+    }
+
+    virtual std::vector<std::shared_ptr<celero::UserDefinedMeasurement>>
+    getUserDefinedMeasurements() const override
+    {
+        return {bytes};
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        size_t const rows = experimentValue.Value;
+        db.reset(new Db{rows, CODEC_ROW});
+        db->set_value_scale(std::is_integral<Value>::value ? CODEC_SCALE : 1.0);
+        std::mt19937 rng{42};
+        double h = 100.0;
+        for (size_t r = 0; r < rows; ++r)
+        {
+            auto* v = db->insert(Point{int(r / 256), int(r % 256)});
+            for (size_t i = 0; i < CODEC_ROW; ++i)
+            {
+                h += double(int(rng() % 21) - 10) * CODEC_SCALE;
+                v->push_back(encode_height<Value>(h, std::is_integral<Value>{}));
+            }
+        }
+        db->sort();
+    }
+
+    virtual void tearDown() override
+    {
+        db.reset();
+    }
+
+    void sum_all()
+    {
+        celero::DoNotOptimizeAway(db->sum());
+        bytes->addBytes(db->memory_usage(), db->count());
+    }
+};
+
+/// The int16 heights delta coded and bit packed
+/// BytesPerValue counts the packed values only
+struct DeltaPackedFixture : public CodecFixture<int16_t>
+{
+    std::unique_ptr<ArenaAllocator> allocator;
+    DeltaPackedValues<int16_t> packed;
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        CodecFixture<int16_t>::setUp(experimentValue);
+        allocator.reset(new ArenaAllocator{});
+        packed = DeltaPackedValues<int16_t>{};
+        packed.build(*allocator, *db);
+    }
+
+    virtual void tearDown() override
+    {
+        CodecFixture<int16_t>::tearDown();
+        allocator.reset();
+    }
+
+    void sum_packed()
+    {
+        celero::DoNotOptimizeAway(packed.sum() * CODEC_SCALE);
+        bytes->addBytes(packed.bytes(), packed.size());
+    }
+};
+
+using Float64Fixture = CodecFixture<double>;
+using Float32Fixture = CodecFixture<float>;
+using Fixed32Fixture = CodecFixture<int32_t>;
+using Fixed16Fixture = CodecFixture<int16_t>;
+
+BASELINE_F(ValueCodec, Float64, Float64Fixture, 0, 256)
+{
+    sum_all();
+}
+
+BENCHMARK_F(ValueCodec, Float32, Float32Fixture, 0, 256)
+{
+    sum_all();
+}
+
+BENCHMARK_F(ValueCodec, Fixed32, Fixed32Fixture, 0, 256)
+{
+    sum_all();
+}
+
+BENCHMARK_F(ValueCodec, Fixed16, Fixed16Fixture, 0, 256)
+{
+    sum_all();
+}
+
+BENCHMARK_F(ValueCodec, DeltaPacked16, DeltaPackedFixture, 0, 256)
+{
+    sum_packed();
+}
+
+/// Experiment value is the number of live keys
+std::vector<celero::TestFixture::ExperimentValue> churnProblemSpace{
+    1 << 12,
+    1 << 16,
+    1 << 20,
+};
+
+constexpr size_t CHURN_WIDTH = 4;
+// erase/insert pairs per sample
+constexpr size_t CHURN_OPS = 1 << 14;
+// the tail is sorted into the prefix this often
+constexpr size_t CHURN_SORT_EVERY = 1 << 12;
+
+/// Steady state insert/erase mix: every operation erases a random live key
+/// and inserts a new one, so the number of live keys stays at experimentValue
+/// A sample ends with a sum over the table, which pays for the rows erased
+/// but not yet compacted. Compaction starts once ThresholdPercent percent of
+/// the rows are erased, 0 never compacts. Reports the memory the database
+/// holds after the sample (MemoryMB).
+template <unsigned ThresholdPercent>
+struct ChurnFixture : public celero::TestFixture
+{
+    std::unique_ptr<ArenaDb> db;
+    std::vector<Point> live;
+    std::mt19937 rng;
+    int next_key = 0;
+    std::shared_ptr<MegabytesMeasurement> memory =
+        std::make_shared<MegabytesMeasurement>("MemoryMB");
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return churnProblemSpace;
+    }
+
+    virtual std::vector<std::shared_ptr<celero::UserDefinedMeasurement>>
+    getUserDefinedMeasurements() const override
+    {
+        return {memory};
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        size_t const n = experimentValue.Value;
+        rng.seed(42);
+        db.reset(new ArenaDb{n, CHURN_WIDTH});
+        db->enable_hash_index();
+        db->set_compaction_threshold(ThresholdPercent == 0 ? 1.0 : ThresholdPercent / 100.0);
+        live.clear();
+        for (next_key = 0; next_key < int(n); ++next_key)
+            insert_key();
+        db->sort();
+    }
+
+    virtual void tearDown() override
+    {
+        db.reset();
+    }
+
+    void insert_key()
+    {
+        live.push_back(Point{int(rng() >> 1), next_key});
+        auto* v = db->insert(live.back());
+        for (size_t j = 0; j < CHURN_WIDTH; ++j)
+            v->push_back(rng() % 100);
+    }
+
+    void churn()
+    {
+        for (size_t op = 0; op < CHURN_OPS; ++op)
+        {
+            size_t const victim = rng() % live.size();
+            db->erase(live[victim]);
+            live[victim] = live.back();
+            live.pop_back();
+            insert_key();
+            ++next_key;
+            if (op % CHURN_SORT_EVERY == CHURN_SORT_EVERY - 1)
+                db->sort();
+        }
+        celero::DoNotOptimizeAway(db->sum());
+        memory->addBytes(db->memory_usage());
+    }
+};
+
+using NeverCompactFixture = ChurnFixture<0>;
+using Compact50Fixture = ChurnFixture<50>;
+using Compact25Fixture = ChurnFixture<25>;
+
+BASELINE_F(Churn, NeverCompact, NeverCompactFixture, 0, 16)
+{
+    churn();
+}
+
+BENCHMARK_F(Churn, Compact50, Compact50Fixture, 0, 16)
+{
+    churn();
+}
+
+BENCHMARK_F(Churn, Compact25, Compact25Fixture, 0, 16)
+{
+    churn();
+}
+
+/// Experiment value is the number of keys in the map
+std::vector<celero::TestFixture::ExperimentValue> mapChurnProblemSpace{
+    1 << 10,
+    1 << 14,
+    1 << 18,
+};
+
+// erase/insert/find triples per sample
+constexpr size_t MAP_CHURN_OPS = 1 << 14;
+
+using PoolNaiveDb = BasicNaiveDb<TypedPool>;
+
+NaiveDb* make_naive_db(PoolAllocator&, NaiveDb const*)
+{
+    return new NaiveDb{};
+}
+
+PoolNaiveDb* make_naive_db(PoolAllocator& pool, PoolNaiveDb const*)
+{
+    return new PoolNaiveDb{TypedPool<PoolNaiveDb::Entry>{pool}};
+}
+
+/// Steady state erase/insert mix on the std::map of a NaiveDb
+/// Every operation erases a random key, inserts a new one and looks up
+/// another, so the map keeps experimentValue keys and frees as many nodes as
+/// it allocates. The nodes and the value vectors of 4 doubles come from the
+/// allocator under test.
+template <typename Db>
+struct MapChurnFixture : public celero::TestFixture
+{
+    ArenaAllocator arena;
+    PoolAllocator pool{arena};
+    std::unique_ptr<Db> db;
+    std::vector<Point> live;
+    std::mt19937 rng;
+    int next_key = 0;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return mapChurnProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        rng.seed(42);
+        db.reset(make_naive_db(pool, static_cast<Db const*>(nullptr)));
+        live.clear();
+        for (next_key = 0; next_key < int(experimentValue.Value); ++next_key)
+            insert_key();
+    }
+
+    virtual void tearDown() override
+    {
+        db.reset();
+        pool.clear();
+        arena.clear();
+    }
+
+    void insert_key()
+    {
+        live.push_back(Point{int(rng() >> 1), next_key});
+        auto v = db->new_values();
+        v.assign(4, double(rng() % 100));
+        db->insert(live.back(), std::move(v));
+    }
+
+    void churn()
+    {
+        double sum = 0.0;
+        for (size_t op = 0; op < MAP_CHURN_OPS; ++op)
+        {
+            size_t const victim = rng() % live.size();
+            db->erase(live[victim]);
+            live[victim] = live.back();
+            live.pop_back();
+            insert_key();
+            ++next_key;
+            sum += db->get(live[rng() % live.size()])->front();
+        }
+        celero::DoNotOptimizeAway(sum);
+    }
+};
+
+using StdMapChurnFixture = MapChurnFixture<NaiveDb>;
+using PoolMapChurnFixture = MapChurnFixture<PoolNaiveDb>;
+
+BASELINE_F(MapChurn, StdAllocator, StdMapChurnFixture, 0, 16)
+{
+    churn();
+}
+
+BENCHMARK_F(MapChurn, Pool, PoolMapChurnFixture, 0, 16)
+{
+    churn();
+}
+
+/// InsertAndFind on NaiveDb with the nodes, buckets and value vectors taken
+/// from Alloc, so map and hash map can be compared with and without the
+/// arena, apart from the data structure
+template <template <typename> class Alloc, bool Hashed>
+struct NaiveAllocatorFixture : public DbFixture
+{
+    using Db = BasicNaiveDb<Alloc, Hashed>;
+
+    void run(Alloc<char> const& allocator)
+    {
+        Db db{Alloc<typename Db::Entry>(allocator)};
+        std::vector<Point> keys;
+        for (int i = 0; i < num_keys; ++i)
+        {
+            keys.push_back(Point{rand(), rand()});
+            auto v = db.new_values();
+            v.reserve(num_values);
+            for (int j = 0; j < num_values; ++j)
+                v.emplace_back(rand());
+            db.insert(keys.back(), std::move(v));
+        }
+        double sum = 0.0;
+        for (auto const& k : keys)
+        {
+            for (auto const x : *db.get(k))
+                sum += x;
+        }
+        celero::DoNotOptimizeAway(sum);
+    }
+};
+
+using StdMapFixture = NaiveAllocatorFixture<std::allocator, false>;
+using ArenaMapFixture = NaiveAllocatorFixture<TypedArena, false>;
+using StdHashMapFixture = NaiveAllocatorFixture<std::allocator, true>;
+using ArenaHashMapFixture = NaiveAllocatorFixture<TypedArena, true>;
+
+BASELINE_F(NaiveAllocator, StdMap, StdMapFixture, 0, 64)
+{
+    run(std::allocator<char>{});
+}
+
+BENCHMARK_F(NaiveAllocator, ArenaMap, ArenaMapFixture, 0, 64)
+{
+    ArenaAllocator arena;
+    run(TypedArena<char>{arena});
+}
+
+BENCHMARK_F(NaiveAllocator, StdHashMap, StdHashMapFixture, 0, 64)
+{
+    run(std::allocator<char>{});
+}
+
+BENCHMARK_F(NaiveAllocator, ArenaHashMap, ArenaHashMapFixture, 0, 64)
+{
+    ArenaAllocator arena;
+    run(TypedArena<char>{arena});
+}
+
+#ifdef ARENA_HAS_PMR
+using PmrMapFixture = NaiveAllocatorFixture<std::pmr::polymorphic_allocator, false>;
+
+BENCHMARK_F(NaiveAllocator, PmrArenaMap, PmrMapFixture, 0, 64)
+{
+    ArenaAllocator arena;
+    ArenaResource resource{arena};
+    run(std::pmr::polymorphic_allocator<char>{&resource});
+}
+#endif
+
+/// Experiment value is the side length of the rectangle of a query
+std::vector<celero::TestFixture::ExperimentValue> scratchProblemSpace{
+    16,
+    64,
+    256,
+};
+
+constexpr size_t SCRATCH_QUERIES = 64;
+// keys of a rectangle whose neighbours are looked up
+constexpr size_t SCRATCH_PROBES = 16;
+constexpr size_t SCRATCH_K = 4;
+
+/// Query loop with per-query scratch data
+/// A query collects the keys of a rectangle, sorts them, finds the
+/// neighbours of the first few and looks the neighbours up. Heap keeps its
+/// scratch data in std::vectors, Scratch takes it from an arena rewound after
+/// every query.
+struct QueryScratchFixture : public RectFixture
+{
+    ArenaAllocator scratch;
+    // chunks far smaller than the corners, which get an oversized chunk
+    ArenaAllocator small_scratch{128};
+    std::vector<Point> corners;
+
+    virtual std::vector<celero::TestFixture::ExperimentValue> getExperimentValues() const override
+    {
+        return scratchProblemSpace;
+    }
+
+    virtual void setUp(const celero::TestFixture::ExperimentValue& experimentValue) override
+    {
+        RectFixture::setUp(experimentValue);
+        db->enable_knn_index();
+        small_scratch.clear();
+        corners.clear();
+        for (size_t i = 0; i < SCRATCH_QUERIES; ++i)
+            corners.push_back(Point{rand() % WORLD_SIZE, rand() % WORLD_SIZE});
+    }
+
+    template <typename Keys>
+    void collect(Point const corner, Keys& keys) const
+    {
+        auto const visit = [&](Point const& p, ArenaDb::VecValues const&) { keys.push_back(p); };
+        db->query_rect(corner.x, corner.y, corner.x + side - 1, corner.y + side - 1, visit);
+        std::sort(keys.begin(), keys.end(), MortonLess{});
+    }
+
+    static double sum_first(ArenaDb::VecValues const* const* found, size_t const n)
+    {
+        double sum = 0.0;
+        for (size_t i = 0; i < n; ++i)
+            sum += found[i] == nullptr ? 0.0 : (*found[i])[0];
+        return sum;
+    }
+};
+
+BASELINE_F(QueryScratch, Heap, QueryScratchFixture, 0, 64)
+{
+    double sum = 0.0;
+    for (Point const corner : corners)
+    {
+        std::vector<Point> keys;
+        collect(corner, keys);
+        size_t const probes = std::min(keys.size(), SCRATCH_PROBES);
+        std::vector<ArenaDb::Neighbour> neighbours(probes * SCRATCH_K);
+        std::vector<size_t> counts(probes);
+        db->nearest_many(keys.data(), probes, SCRATCH_K, neighbours.data(), counts.data());
+        std::vector<Point> lookups;
+        for (size_t q = 0; q < probes; ++q)
+        {
+            for (size_t j = 0; j < counts[q]; ++j)
+                lookups.push_back(neighbours[q * SCRATCH_K + j].key);
+        }
+        std::vector<ArenaDb::VecValues const*> found(lookups.size());
+        db->get_many(lookups.data(), lookups.size(), found.data());
+        sum += sum_first(found.data(), found.size());
+    }
+    celero::DoNotOptimizeAway(sum);
+}
+
+BENCHMARK_F(QueryScratch, Scratch, QueryScratchFixture, 0, 64)
+{
+    double sum = 0.0;
+    for (Point const corner : corners)
+    {
+        ArenaScope const scope{scratch};
+        std::vector<Point, TypedArena<Point>> keys{TypedArena<Point>{scratch}};
+        collect(corner, keys);
+        size_t const probes = std::min(keys.size(), SCRATCH_PROBES);
+        auto* const neighbours = scratch.allocate<ArenaDb::Neighbour>(probes * SCRATCH_K);
+        auto* const counts = scratch.allocate<size_t>(probes);
+        db->nearest_many(keys.data(), probes, SCRATCH_K, neighbours, counts, scratch);
+        auto* const lookups = scratch.allocate<Point>(probes * SCRATCH_K);
+        size_t m = 0;
+        for (size_t q = 0; q < probes; ++q)
+        {
+            for (size_t j = 0; j < counts[q]; ++j)
+                lookups[m++] = neighbours[q * SCRATCH_K + j].key;
+        }
+        auto const** const found = db->get_many(lookups, m, scratch);
+        sum += sum_first(found, m);
+    }
+    celero::DoNotOptimizeAway(sum);
+}
+
+/// Scratch with the corners copied to the scratch arena before the queries,
+/// they must survive every rewind
+BENCHMARK_F(QueryScratch, ScratchPinned, QueryScratchFixture, 0, 64)
+{
+    ArenaScope const pinned_scope{small_scratch};
+    Point* const pinned = small_scratch.allocate<Point>(corners.size());
+    std::copy(corners.begin(), corners.end(), pinned);
+    double sum = 0.0;
+    for (size_t i = 0; i < corners.size(); ++i)
+    {
+        ArenaScope const scope{small_scratch};
+        std::vector<Point, TypedArena<Point>> keys{TypedArena<Point>{small_scratch}};
+        collect(pinned[i], keys);
+        size_t const probes = std::min(keys.size(), SCRATCH_PROBES);
+        auto* const neighbours = small_scratch.allocate<ArenaDb::Neighbour>(probes * SCRATCH_K);
+        auto* const counts = small_scratch.allocate<size_t>(probes);
+        db->nearest_many(keys.data(), probes, SCRATCH_K, neighbours, counts, small_scratch);
+        auto* const lookups = small_scratch.allocate<Point>(probes * SCRATCH_K);
+        size_t m = 0;
+        for (size_t q = 0; q < probes; ++q)
+        {
+            for (size_t j = 0; j < counts[q]; ++j)
+                lookups[m++] = neighbours[q * SCRATCH_K + j].key;
+        }
+        auto const** const found = db->get_many(lookups, m, small_scratch);
+        sum += sum_first(found, m);
+    }
+    assert(std::equal(corners.begin(), corners.end(), pinned));
+    celero::DoNotOptimizeAway(sum);
+}
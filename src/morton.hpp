@@ -0,0 +1,97 @@
+#pragma once
+#include "point.hpp"
+#include <cstdint>
+
+/// Z-order (Morton) codes for Point
+/// The x bits are interleaved above the y bits. Coordinates are sign-flipped
+/// first, so the code of a point is monotone in both x and y and any
+/// rectangle is contained in the code interval [code(min), code(max)].
+
+namespace morton
+{
+constexpr uint64_t EVEN_BITS = 0x5555555555555555ULL;
+constexpr uint64_t ODD_BITS = 0xaaaaaaaaaaaaaaaaULL;
+
+inline uint64_t spread(uint32_t const v) noexcept
+{
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | (x << 2)) & 0x3333333333333333ULL;
+    x = (x | (x << 1)) & EVEN_BITS;
+    return x;
+}
+
+/// Inverse of spread
+inline uint32_t compact(uint64_t x) noexcept
+{
+    x &= EVEN_BITS;
+    x = (x | (x >> 1)) & 0x3333333333333333ULL;
+    x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | (x >> 4)) & 0x00ff00ff00ff00ffULL;
+    x = (x | (x >> 8)) & 0x0000ffff0000ffffULL;
+    x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+    return uint32_t(x);
+}
+
+inline uint64_t encode(Point const p) noexcept
+{
+    uint32_t const x = uint32_t(p.x) ^ 0x80000000u;
+    uint32_t const y = uint32_t(p.y) ^ 0x80000000u;
+    return (spread(x) << 1) | spread(y);
+}
+
+inline Point decode(uint64_t const code) noexcept
+{
+    return Point{int(compact(code >> 1) ^ 0x80000000u), int(compact(code) ^ 0x80000000u)};
+}
+
+/// The smallest code greater than zval that lies inside the rectangle
+/// spanned by the codes zmin and zmax (Tropf and Herzog's BIGMIN)
+/// zval must be inside [zmin, zmax] but outside the rectangle
+inline uint64_t bigmin(uint64_t const zval, uint64_t zmin, uint64_t zmax) noexcept
+{
+    uint64_t result = 0;
+    for (int b = 63; b >= 0; --b)
+    {
+        uint64_t const bit = uint64_t(1) << b;
+        // lower bits that belong to the same dimension as bit
+        uint64_t const below = (bit - 1) & ((b & 1) ? ODD_BITS : EVEN_BITS);
+
+        bool const v = (zval & bit) != 0;
+        bool const lo = (zmin & bit) != 0;
+        bool const hi = (zmax & bit) != 0;
+
+        if (!v && !lo && hi)
+        {
+            // the rectangle straddles the split, the upper half starts at
+            // 1000... and the lower half ends at 0111...
+            result = (zmin & ~(bit | below)) | bit;
+            zmax = (zmax & ~(bit | below)) | below;
+        }
+        else if (!v && lo && hi)
+        {
+            return zmin;
+        }
+        else if (v && !lo && !hi)
+        {
+            return result;
+        }
+        else if (v && !lo && hi)
+        {
+            zmin = (zmin & ~(bit | below)) | bit;
+        }
+    }
+    return result;
+}
+} // namespace morton
+
+/// Orders Points along the Z-order curve
+struct MortonLess
+{
+    bool operator()(Point const& a, Point const& b) const noexcept
+    {
+        return morton::encode(a) < morton::encode(b);
+    }
+};
@@ -0,0 +1,37 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace parallel
+{
+/// Call f(i) for every i in [0, count) on up to threads threads, including
+/// the calling one
+/// Indices are handed out one at a time, so tasks of uneven size balance
+/// across the threads. Returns once every call returned.
+template <typename F>
+void for_each_index(size_t const count, unsigned const threads, F const& f)
+{
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t i; (i = next.fetch_add(1)) < count;)
+            f(i);
+    };
+    size_t const helpers = std::min(count, size_t(std::max(threads, 1u))) - (count != 0);
+    std::vector<std::thread> pool;
+    pool.reserve(helpers);
+    for (size_t t = 0; t < helpers; ++t)
+        pool.emplace_back(work);
+    work();
+    for (auto& t : pool)
+        t.join();
+}
+
+/// Threads of the machine, at least 1
+inline unsigned hardware_threads() noexcept
+{
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+} // namespace parallel
@@ -1,4 +1,6 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
 
 struct Point
 {
@@ -25,3 +27,78 @@ struct Point
     }
 };
 
+/// 64 bit code that orders like Point::operator<
+/// Both coordinates are sign-flipped so they compare as unsigned numbers, x
+/// goes in the high half
+inline uint64_t lexicographic_code(Point const p) noexcept
+{
+    return (uint64_t(uint32_t(p.x) ^ 0x80000000u) << 32) | (uint32_t(p.y) ^ 0x80000000u);
+}
+
+inline Point from_lexicographic_code(uint64_t const code) noexcept
+{
+    return Point{int(uint32_t(code >> 32) ^ 0x80000000u), int(uint32_t(code) ^ 0x80000000u)};
+}
+
+/// Whether p lies in the rectangle [x0, x1] x [y0, y1]
+inline bool in_rect(Point const p, int x0, int y0, int x1, int y1) noexcept
+{
+    return x0 <= p.x && p.x <= x1 && y0 <= p.y && p.y <= y1;
+}
+
+/// 64 bit hash of a Point
+/// Both coordinates are packed into one word and run through a murmur3 style
+/// finalizer, so the high bits are safe to use for power of two tables
+inline uint64_t hash_point(Point const p) noexcept
+{
+    uint64_t h = (uint64_t(uint32_t(p.x)) << 32) | uint32_t(p.y);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+struct PointHash
+{
+    size_t operator()(Point const p) const noexcept
+    {
+        return size_t(hash_point(p));
+    }
+};
+
+/// Point in 3D, ordered by x, then y, then z
+struct Point3
+{
+    int x, y, z;
+
+    bool operator<(Point3 const& p) const noexcept
+    {
+        return x < p.x || (x == p.x && (y < p.y || (y == p.y && z < p.z)));
+    }
+
+    bool operator==(Point3 const& p) const noexcept
+    {
+        return x == p.x && y == p.y && z == p.z;
+    }
+
+    bool operator!=(Point3 const& p) const noexcept
+    {
+        return !(*this == p);
+    }
+};
+
+/// 64 bit hash of a Point3
+/// hash_point of x and y with z folded in before the finalizer
+inline uint64_t hash_point3(Point3 const p) noexcept
+{
+    uint64_t h = (uint64_t(uint32_t(p.x)) << 32) | uint32_t(p.y);
+    h ^= uint64_t(uint32_t(p.z)) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
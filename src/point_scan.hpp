@@ -0,0 +1,110 @@
+#pragma once
+#include "cpu.hpp"
+#include "point.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if ARENA_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/// Position of the first p[i] equal to key in p[0, n), n if there is none
+using FindPointKernel = size_t (*)(Point const* p, size_t n, Point key);
+
+namespace kernels
+{
+static_assert(sizeof(Point) == sizeof(uint64_t), "Points are compared as 64 bit words");
+
+inline uint64_t pack(Point const p) noexcept
+{
+    uint64_t packed;
+    std::memcpy(&packed, &p, sizeof(packed));
+    return packed;
+}
+
+inline size_t find_point_scalar(Point const* p, size_t const n, Point const key)
+{
+    return std::find(p, p + n, key) - p;
+}
+
+#if ARENA_X86_SIMD
+/// 16 Points per iteration, four compares of 4 packed Points each
+ARENA_TARGET("avx2") inline size_t find_point_avx2(Point const* p, size_t const n, Point const key)
+{
+    __m256i const k = _mm256_set1_epi64x(int64_t(pack(key)));
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i const a = _mm256_cmpeq_epi64(_mm256_loadu_si256((__m256i const*)(p + i)), k);
+        __m256i const b = _mm256_cmpeq_epi64(_mm256_loadu_si256((__m256i const*)(p + i + 4)), k);
+        __m256i const c = _mm256_cmpeq_epi64(_mm256_loadu_si256((__m256i const*)(p + i + 8)), k);
+        __m256i const d = _mm256_cmpeq_epi64(_mm256_loadu_si256((__m256i const*)(p + i + 12)), k);
+        // one test for all four, the hit is located only once there is one
+        __m256i const any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (_mm256_testz_si256(any, any))
+            continue;
+        unsigned const mask = unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(a))) |
+                              (unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(b))) << 4) |
+                              (unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(c))) << 8) |
+                              (unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(d))) << 12);
+        // index of the lowest set bit
+        return i + floor_log2(mask & (0u - mask));
+    }
+    return i + find_point_scalar(p + i, n - i, key);
+}
+
+/// 16 Points per iteration, the last partial vector uses a masked load
+ARENA_TARGET("avx512f")
+inline size_t find_point_avx512(Point const* p, size_t const n, Point const key)
+{
+    __m512i const k = _mm512_set1_epi64(int64_t(pack(key)));
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512i const a = _mm512_loadu_si512(p + i);
+        __m512i const b = _mm512_loadu_si512(p + i + 8);
+        unsigned const mask = unsigned(_mm512_cmpeq_epi64_mask(a, k)) |
+                              (unsigned(_mm512_cmpeq_epi64_mask(b, k)) << 8);
+        if (mask != 0)
+            return i + floor_log2(mask & (0u - mask));
+    }
+    for (; i < n; i += 8)
+    {
+        __mmask8 const valid = n - i >= 8 ? __mmask8(0xff) : __mmask8((1u << (n - i)) - 1);
+        __m512i const v = _mm512_maskz_loadu_epi64(valid, p + i);
+        unsigned const mask = _mm512_mask_cmpeq_epi64_mask(valid, v, k);
+        if (mask != 0)
+            return i + floor_log2(mask & (0u - mask));
+    }
+    return n;
+}
+#endif
+} // namespace kernels
+
+/// Kernel for the given SIMD level, or the best one the running CPU
+/// supports if that is lower
+inline FindPointKernel find_point_kernel(SimdLevel level)
+{
+#if ARENA_X86_SIMD
+    level = std::min(level, simd_level());
+    switch (level)
+    {
+    case SimdLevel::Avx512:
+        return &kernels::find_point_avx512;
+    case SimdLevel::Avx2:
+        return &kernels::find_point_avx2;
+    default:
+        break;
+    }
+#endif
+    return &kernels::find_point_scalar;
+}
+
+/// Kernel for the running CPU
+inline FindPointKernel find_point_kernel()
+{
+    static FindPointKernel const best = find_point_kernel(simd_level());
+    return best;
+}
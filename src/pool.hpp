@@ -0,0 +1,182 @@
+#pragma once
+#include "arena.hpp"
+#include "cpu.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+/// Allocator with an intrusive free list per size class, on top of an
+/// ArenaAllocator
+/// A request is rounded up to its size class. Blocks are taken from the free
+/// list of the class, or carved from the arena when it is empty; a freed
+/// block goes back on that list. Containers that free and reallocate, such
+/// as the nodes of a std::map with churn, therefore stay within the memory
+/// they peaked at instead of growing the arena forever.
+/// Classes are SMALL_STEP bytes apart up to SMALL_MAX bytes and powers of two
+/// up to MAX_POOLED bytes. Larger blocks come from operator new.
+/// !!Important!! this object does not manage memory.
+/// The blocks live in the ArenaAllocator passed to the ctor. Clearing the
+/// arena invalidates them, clear the pool along with it.
+class PoolAllocator final
+{
+public:
+    /// Every block is aligned to this
+    static constexpr size_t ALIGNMENT = 16;
+    static constexpr size_t MAX_POOLED = size_t(1) << 16;
+
+private:
+    static constexpr size_t SMALL_STEP = 16;
+    static constexpr size_t SMALL_MAX = 256;
+    static constexpr size_t SMALL_CLASSES = SMALL_MAX / SMALL_STEP;
+    // 512, 1024, ... MAX_POOLED
+    static constexpr size_t CLASSES = SMALL_CLASSES + 8;
+
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    ArenaAllocator* arena;
+    FreeBlock* free_lists[CLASSES] = {};
+    size_t used = 0;
+
+public:
+    explicit PoolAllocator(ArenaAllocator& arena) : arena(&arena)
+    {
+    }
+
+    PoolAllocator(PoolAllocator const&) = delete;
+    PoolAllocator& operator=(PoolAllocator const&) = delete;
+
+    void* allocate(size_t const bytes)
+    {
+        if (bytes > MAX_POOLED)
+        {
+            used += bytes;
+            return ::operator new(bytes);
+        }
+        size_t const c = size_class(bytes);
+        used += class_size(c);
+        FreeBlock* const block = free_lists[c];
+        if (block == nullptr)
+            return arena->allocate<char>(class_size(c), ALIGNMENT);
+        free_lists[c] = block->next;
+        return block;
+    }
+
+    /// bytes must be the size the block was allocated with
+    void deallocate(void* const p, size_t const bytes) noexcept
+    {
+        if (p == nullptr)
+            return;
+        if (bytes > MAX_POOLED)
+        {
+            used -= bytes;
+            ::operator delete(p);
+            return;
+        }
+        size_t const c = size_class(bytes);
+        used -= class_size(c);
+        FreeBlock* const block = static_cast<FreeBlock*>(p);
+        block->next = free_lists[c];
+        free_lists[c] = block;
+    }
+
+    /// Bytes of the blocks handed out and not freed, rounded up to their
+    /// size classes
+    size_t bytes_in_use() const noexcept
+    {
+        return used;
+    }
+
+    /// Forget the free lists, call it when the arena is cleared
+    /// Blocks larger than MAX_POOLED are not tracked, free them first
+    void clear() noexcept
+    {
+        std::fill(free_lists, free_lists + CLASSES, nullptr);
+        used = 0;
+    }
+
+    ArenaAllocator& backend() const noexcept
+    {
+        return *arena;
+    }
+
+    bool operator==(PoolAllocator const& other) const noexcept
+    {
+        return this == &other;
+    }
+
+    bool operator!=(PoolAllocator const& other) const noexcept
+    {
+        return this != &other;
+    }
+
+private:
+    static size_t size_class(size_t const bytes) noexcept
+    {
+        if (bytes <= SMALL_MAX)
+            return (std::max(bytes, size_t(1)) - 1) / SMALL_STEP;
+        // 257..512 is the first power of two class
+        return SMALL_CLASSES + floor_log2(bytes - 1) - 8;
+    }
+
+    static size_t class_size(size_t const c) noexcept
+    {
+        return c < SMALL_CLASSES ? (c + 1) * SMALL_STEP : size_t(1) << (c - SMALL_CLASSES + 9);
+    }
+};
+
+/// Typed PoolAllocator to be used in container templates
+/// Unlike TypedArena it frees, and it converts to the pool allocator of any
+/// other type, which node based containers need to allocate their nodes
+/// Not final, containers may derive from their allocator
+template <typename T>
+class TypedPool
+{
+    static_assert(alignof(T) <= PoolAllocator::ALIGNMENT, "over-aligned types are not pooled");
+
+    PoolAllocator* _pool;
+
+public:
+    using value_type = T;
+
+    explicit TypedPool(PoolAllocator& pool) noexcept : _pool(&pool)
+    {
+    }
+
+    template <typename U>
+    TypedPool(TypedPool<U> const& other) noexcept : _pool(&other.pool())
+    {
+    }
+
+    TypedPool() = delete;
+
+    T* allocate(size_t const n)
+    {
+        return static_cast<T*>(_pool->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* const p, size_t const n) noexcept
+    {
+        _pool->deallocate(p, n * sizeof(T));
+    }
+
+    PoolAllocator& pool() const noexcept
+    {
+        return *_pool;
+    }
+
+    template <typename U>
+    bool operator==(TypedPool<U> const& other) const noexcept
+    {
+        return _pool == &other.pool();
+    }
+
+    template <typename U>
+    bool operator!=(TypedPool<U> const& other) const noexcept
+    {
+        return !(*this == other);
+    }
+};
@@ -0,0 +1,154 @@
+#pragma once
+#include "arena.hpp"
+#include "segmented.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// Values of rows of any length, the storage of ArenaDb's ragged layout
+/// Sealed rows are packed back to back in row order, the values of row r are
+/// [offsets[r], offsets[r + 1]) of the packed array (CSR). Rows added since
+/// the last seal live in an append buffer with the capacity they were added
+/// with, seal moves their values behind the sealed ones and drops the unused
+/// capacity.
+/// !!Important!! the packed values and offsets are not managed by this
+/// object, they are taken from the ArenaAllocator passed to seal. The append
+/// buffer is heap memory that seal releases.
+template <typename Value>
+class RaggedValues final
+{
+    // values per append block, rows larger than this get a block of their own
+    static constexpr size_t APPEND_BLOCK = size_t(1) << 16;
+
+    Value* packed = nullptr;
+    size_t packed_size = 0;
+    size_t packed_capacity = 0;
+    // sealed_rows + 1 entries while any row is sealed
+    uint64_t* offsets = nullptr;
+    size_t offsets_capacity = 0;
+    size_t sealed_rows = 0;
+
+    std::vector<std::unique_ptr<Value[]>> blocks;
+    size_t block_used = 0;
+    size_t block_capacity = 0;
+    size_t append_values = 0;
+
+public:
+    RaggedValues() = default;
+    RaggedValues(RaggedValues const&) = delete;
+    RaggedValues& operator=(RaggedValues const&) = delete;
+    RaggedValues(RaggedValues&&) = default;
+    RaggedValues& operator=(RaggedValues&&) = default;
+
+    /// Number of rows whose values are packed
+    size_t sealed() const noexcept
+    {
+        return sealed_rows;
+    }
+
+    /// Values of all sealed rows in row order
+    Value const* packed_values() const noexcept
+    {
+        return packed;
+    }
+
+    size_t packed_count() const noexcept
+    {
+        return packed_size;
+    }
+
+    /// Bytes held by the append buffer
+    size_t heap_bytes() const noexcept
+    {
+        return append_values * sizeof(Value);
+    }
+
+    /// Room for a new row of up to n values in the append buffer
+    Value* allocate(size_t const n)
+    {
+        if (blocks.empty() || block_used + n > block_capacity)
+        {
+            block_capacity = std::max(n, size_t(APPEND_BLOCK));
+            blocks.emplace_back(new Value[block_capacity]);
+            append_values += block_capacity;
+            block_used = 0;
+        }
+        Value* const row = blocks.back().get() + block_used;
+        block_used += n;
+        return row;
+    }
+
+    /// Pack the rows from sealed() to the end of views behind the sealed ones
+    /// and point their views at the packed values
+    /// Sealed views are full, their size is their capacity. If the packed
+    /// array has to grow every view is moved to the new one.
+    template <typename View>
+    void seal(ArenaAllocator& allocator, SegmentedArray<View>& views)
+    {
+        size_t const rows = views.size();
+        if (rows == sealed_rows)
+            return;
+        size_t added = 0;
+        for (size_t r = sealed_rows; r < rows; ++r)
+            added += views[r].size();
+
+        if (rows + 1 > offsets_capacity)
+        {
+            size_t const capacity = std::max(rows + 1, 2 * offsets_capacity);
+            uint64_t* const grown = allocator.allocate<uint64_t>(capacity);
+            std::copy(offsets, offsets + (sealed_rows == 0 ? 0 : sealed_rows + 1), grown);
+            offsets = grown;
+            offsets_capacity = capacity;
+        }
+        if (sealed_rows == 0)
+            offsets[0] = 0;
+        if (packed_size + added > packed_capacity)
+        {
+            // the first seal allocates exactly what it needs
+            size_t const capacity =
+                packed_capacity == 0 ? added : std::max(packed_size + added, 2 * packed_capacity);
+            Value* const grown = allocator.allocate<Value>(capacity, CACHE_LINE_SIZE);
+            std::copy(packed, packed + packed_size, grown);
+            packed = grown;
+            packed_capacity = capacity;
+            for (size_t r = 0; r < sealed_rows; ++r)
+                point(views[r], r);
+        }
+        for (size_t r = sealed_rows; r < rows; ++r)
+        {
+            View& v = views[r];
+            std::copy(v.begin(), v.end(), packed + packed_size);
+            packed_size += v.size();
+            offsets[r + 1] = packed_size;
+            point(v, r);
+        }
+        sealed_rows = rows;
+        release_append_buffer();
+    }
+
+    /// Forget all rows, the packed array and the offsets are kept for reuse
+    void clear() noexcept
+    {
+        packed_size = 0;
+        sealed_rows = 0;
+        release_append_buffer();
+    }
+
+private:
+    template <typename View>
+    void point(View& v, size_t const r) noexcept
+    {
+        size_t const n = size_t(offsets[r + 1] - offsets[r]);
+        v = View{packed + offsets[r], n};
+        v.resize(n);
+    }
+
+    void release_append_buffer() noexcept
+    {
+        blocks.clear();
+        block_used = 0;
+        block_capacity = 0;
+        append_values = 0;
+    }
+};
@@ -0,0 +1,146 @@
+#pragma once
+#include "arena.hpp"
+#include "cpu.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+/// Array that grows by adding segments, elements never move
+/// Segment 0 holds first_capacity (rounded up to a power of two) elements,
+/// every later segment doubles the total capacity, so an index maps to its
+/// segment with a single bit scan.
+/// !!Important!! this object does not manage memory.
+/// Segments are taken from the ArenaAllocator passed to push_back.
+template <typename T>
+class SegmentedArray final
+{
+public:
+    // enough segments to address 2^32 elements from a first segment of 1
+    static constexpr size_t MAX_SEGMENTS = 33;
+
+private:
+    T* segments[MAX_SEGMENTS] = {};
+    size_t segment_count = 0;
+    unsigned first_bits;
+    size_t _size = 0;
+
+public:
+    explicit SegmentedArray(size_t const first_capacity)
+        : first_bits(first_capacity > 1 ? floor_log2(first_capacity - 1) + 1 : 0)
+    {
+    }
+
+    SegmentedArray(SegmentedArray const&) = delete;
+    SegmentedArray& operator=(SegmentedArray const&) = delete;
+    SegmentedArray(SegmentedArray&&) = default;
+    SegmentedArray& operator=(SegmentedArray&&) = default;
+
+    /// Split an index into its segment and the offset in that segment
+    void locate(size_t const index, size_t& segment, size_t& offset) const noexcept
+    {
+        if ((index >> first_bits) == 0)
+        {
+            segment = 0;
+            offset = index;
+            return;
+        }
+        unsigned const top = floor_log2(index);
+        segment = top - first_bits + 1;
+        offset = index - (size_t(1) << top);
+    }
+
+    /// Number of elements segment s holds
+    size_t segment_capacity(size_t const s) const noexcept
+    {
+        return s == 0 ? size_t(1) << first_bits : size_t(1) << (first_bits + s - 1);
+    }
+
+    size_t capacity() const noexcept
+    {
+        return segment_count == 0 ? 0 : size_t(1) << (first_bits + segment_count - 1);
+    }
+
+    size_t size() const noexcept
+    {
+        return _size;
+    }
+
+    T& operator[](size_t const index) noexcept
+    {
+        assert(index < _size);
+        size_t segment, offset;
+        locate(index, segment, offset);
+        return segments[segment][offset];
+    }
+
+    T const& operator[](size_t const index) const noexcept
+    {
+        assert(index < _size);
+        size_t segment, offset;
+        locate(index, segment, offset);
+        return segments[segment][offset];
+    }
+
+    T& at(size_t const index) noexcept
+    {
+        return (*this)[index];
+    }
+
+    T const& at(size_t const index) const noexcept
+    {
+        return (*this)[index];
+    }
+
+    /// Append an item, adding a segment if the array is full
+    T& push_back(ArenaAllocator& allocator, T item)
+    {
+        if (_size == capacity())
+        {
+            assert(segment_count < MAX_SEGMENTS);
+            // segments survive clear(), reuse them before allocating
+            if (segments[segment_count] == nullptr)
+                segments[segment_count] =
+                    allocator.allocate<T>(segment_capacity(segment_count));
+            ++segment_count;
+        }
+        size_t segment, offset;
+        locate(_size, segment, offset);
+        T* ptr = new (segments[segment] + offset) T{std::move(item)};
+        ++_size;
+        return *ptr;
+    }
+
+    T& back() noexcept
+    {
+        return (*this)[_size - 1];
+    }
+
+    /// Forget the elements from n on, segments are kept for reuse
+    void truncate(size_t const n) noexcept
+    {
+        assert(n <= _size);
+        _size = n;
+    }
+
+    /// Forget all elements, segments are kept for reuse
+    void clear() noexcept
+    {
+        _size = 0;
+        segment_count = 0;
+    }
+
+    /// Call f(T* begin, size_t n) for the used part of every segment in order
+    template <typename F>
+    void for_each_segment(F&& f) const
+    {
+        size_t left = _size;
+        for (size_t s = 0; left != 0; ++s)
+        {
+            size_t const n = std::min(left, segment_capacity(s));
+            f(segments[s], n);
+            left -= n;
+        }
+    }
+};
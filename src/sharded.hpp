@@ -0,0 +1,150 @@
+#pragma once
+#include "chunk_source.hpp"
+#include "db.hpp"
+#include "parallel.hpp"
+#include "point.hpp"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/// ArenaDb split into independently locked shards
+/// Keys are assigned to a shard by hash_point. Every shard owns an ArenaDb with
+/// its own ArenaAllocator and hash index, so threads working on different
+/// shards never contend.
+/// Callbacks run while the shard of their key is locked, VecValues references
+/// must not escape them.
+class ShardedArenaDb final
+{
+public:
+    using VecValues = ArenaDb::VecValues;
+
+private:
+    struct Shard
+    {
+        std::mutex lock;
+        ArenaDb db;
+
+        Shard(size_t const key_capacity, size_t const value_capacity, ChunkSource const source)
+            : db{key_capacity, value_capacity, source}
+        {
+            db.enable_hash_index();
+        }
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    size_t mask;
+
+public:
+    explicit ShardedArenaDb() = delete;
+    /// shard_count is rounded up to a power of two, key_capacity is a hint for
+    /// the whole database
+    explicit ShardedArenaDb(size_t shard_count,
+                            size_t key_capacity,
+                            size_t value_capacity = 30,
+                            ChunkSource source = ChunkSource::Heap)
+    {
+        size_t n = 1;
+        while (n < shard_count)
+            n *= 2;
+        mask = n - 1;
+        shards.reserve(n);
+        for (size_t i = 0; i < n; ++i)
+            shards.emplace_back(new Shard{key_capacity / n + 1, value_capacity, source});
+    }
+
+    ShardedArenaDb(ShardedArenaDb const&) = delete;
+    ShardedArenaDb& operator=(ShardedArenaDb const&) = delete;
+
+    size_t shard_count() const noexcept
+    {
+        return shards.size();
+    }
+
+    /// Number of keys in all shards
+    size_t size() const
+    {
+        size_t n = 0;
+        for (auto const& shard : shards)
+        {
+            std::lock_guard<std::mutex> guard{shard->lock};
+            n += shard->db.key_count();
+        }
+        return n;
+    }
+
+    /// Insert p and call fill(VecValues&) on its new values
+    /// Returns false and leaves the values alone if p is already present,
+    /// checking first is not enough when other threads insert too
+    template <typename F>
+    bool insert(Point const p, F&& fill)
+    {
+        Shard& shard = shard_of(p);
+        std::lock_guard<std::mutex> guard{shard.lock};
+        if (shard.db.get(p) != nullptr)
+            return false;
+        fill(*shard.db.insert(p));
+        return true;
+    }
+
+    /// Call read(VecValues const&) on the values of p
+    /// Returns false if p is not present
+    template <typename F>
+    bool get(Point const p, F&& read) const
+    {
+        Shard& shard = shard_of(p);
+        std::lock_guard<std::mutex> guard{shard.lock};
+        VecValues const* v = shard.db.get(p);
+        if (v == nullptr)
+            return false;
+        read(*v);
+        return true;
+    }
+
+    /// Sort every shard, shards are sorted in parallel
+    void sort()
+    {
+        for_each_shard_parallel([](size_t, ArenaDb& db) { db.sort(); });
+    }
+
+    /// Call f(VecValues const&) for every row
+    /// Shards are scanned in parallel, f must be safe to call from several
+    /// threads at once
+    template <typename F>
+    void scan(F&& f) const
+    {
+        for_each_shard_parallel([&f](size_t, ArenaDb& db) { db.scan(f); });
+    }
+
+    /// Sum of all values, shards are summed in parallel
+    /// The partial sums are added in shard order so the result does not depend
+    /// on the scheduling
+    double sum(ReduceKernels const& kernels = reduce_kernels()) const
+    {
+        std::vector<double> partial(shards.size());
+        for_each_shard_parallel(
+            [&](size_t const i, ArenaDb& db) { partial[i] = db.sum(kernels); });
+        double total = 0.0;
+        for (double const s : partial)
+            total += s;
+        return total;
+    }
+
+private:
+    Shard& shard_of(Point const p) const noexcept
+    {
+        // the hash index of the shard uses the high bits of the same hash
+        return *shards[hash_point(p) & mask];
+    }
+
+    /// Call f(shard index, ArenaDb&) for every shard with the shard locked
+    /// Uses up to hardware_concurrency threads including the calling one
+    template <typename F>
+    void for_each_shard_parallel(F&& f) const
+    {
+        parallel::for_each_index(shards.size(), parallel::hardware_threads(), [&](size_t const i) {
+            std::lock_guard<std::mutex> guard{shards[i]->lock};
+            f(i, shards[i]->db);
+        });
+    }
+};
@@ -0,0 +1,445 @@
+#pragma once
+#include "chunk_source.hpp"
+#include "db.hpp"
+#include "eytzinger.hpp"
+#include "morton.hpp"
+#include "point.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if ARENA_HAS_MMAP
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+/// First bytes of a snapshot file
+/// Sections are addressed by their offset from the start of the file, so the
+/// file can be used wherever it is mapped. Every section starts at a cache
+/// line aligned offset.
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    // SNAPSHOT_BYTE_ORDER as the writer saw it
+    uint32_t byte_order;
+    // KeyOrder of the keys
+    uint32_t key_order;
+    uint32_t reserved;
+    uint64_t key_count;
+    uint64_t value_count;
+    // Point[key_count], sorted in key_order
+    uint64_t keys_offset;
+    // uint64_t[key_count + 1], values of key i are [value_offsets[i], value_offsets[i + 1])
+    uint64_t value_offsets_offset;
+    // double[value_count]
+    uint64_t values_offset;
+    // uint64_t[key_count + 1], codes of the keys in Eytzinger order, slot 0 unused
+    uint64_t codes_offset;
+    // uint32_t[key_count + 1], position of the key of every code
+    uint64_t positions_offset;
+    uint64_t file_size;
+};
+
+constexpr char SNAPSHOT_MAGIC[8] = {'A', 'R', 'E', 'N', 'A', 'D', 'B', '\0'};
+
+/// Read-only view of the values of one key in a snapshot
+/// Spans of missing keys are empty and convert to false
+struct ValueSpan
+{
+    double const* first;
+    double const* last;
+
+    explicit operator bool() const noexcept
+    {
+        return first != nullptr;
+    }
+
+    double const* begin() const noexcept
+    {
+        return first;
+    }
+
+    double const* end() const noexcept
+    {
+        return last;
+    }
+
+    size_t size() const noexcept
+    {
+        return last - first;
+    }
+
+    double operator[](size_t const i) const noexcept
+    {
+        return first[i];
+    }
+};
+
+namespace snapshot
+{
+inline uint64_t align_section(uint64_t const offset) noexcept
+{
+    return (offset + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+/// Sequential writer that pads up to the start of every section
+class Writer final
+{
+    std::FILE* file;
+    uint64_t written = 0;
+
+public:
+    explicit Writer(std::FILE* file) : file(file)
+    {
+    }
+
+    void write(void const* data, size_t const bytes)
+    {
+        if (bytes != 0 && std::fwrite(data, 1, bytes, file) != bytes)
+            throw std::runtime_error("snapshot: write failed");
+        written += bytes;
+    }
+
+    void seek_section(uint64_t const offset)
+    {
+        static char const zeros[CACHE_LINE_SIZE] = {};
+        while (written < offset)
+            write(zeros, size_t(std::min<uint64_t>(offset - written, sizeof(zeros))));
+    }
+};
+} // namespace snapshot
+
+/// Write the keys and values of db to path, db is sorted first
+/// The file is written next to path and renamed over it once it is complete,
+/// so readers never see a partial snapshot
+/// Throw std::runtime_error if the file cannot be written
+inline void write_snapshot(ArenaDb& db, std::string const& path)
+{
+    db.sort();
+    size_t const n = db.key_count();
+    std::vector<Point> keys;
+    std::vector<uint64_t> value_offsets;
+    keys.reserve(n);
+    value_offsets.reserve(n + 1);
+    value_offsets.push_back(0);
+    for (auto it = db.begin(); it != db.end(); ++it)
+    {
+        keys.push_back(it.first());
+        value_offsets.push_back(value_offsets.back() + it.second().size());
+    }
+
+    std::vector<uint64_t> codes(n + 1);
+    std::vector<uint32_t> positions(n + 1);
+    {
+        std::vector<uint32_t> identity(n);
+        std::iota(identity.begin(), identity.end(), 0u);
+        if (db.key_order() == KeyOrder::Morton)
+            eytzinger::layout(
+                keys.data(), identity.data(), n, &morton::encode, codes.data(), positions.data());
+        else
+            eytzinger::layout(keys.data(),
+                              identity.data(),
+                              n,
+                              &lexicographic_code,
+                              codes.data(),
+                              positions.data());
+    }
+
+    SnapshotHeader header = {};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.key_order = uint32_t(db.key_order());
+    header.key_count = n;
+    header.value_count = value_offsets.back();
+    uint64_t end = sizeof(SnapshotHeader);
+    auto section = [&end](uint64_t const bytes) {
+        uint64_t const at = snapshot::align_section(end);
+        end = at + bytes;
+        return at;
+    };
+    header.keys_offset = section(n * sizeof(Point));
+    header.value_offsets_offset = section((n + 1) * sizeof(uint64_t));
+    header.values_offset = section(header.value_count * sizeof(double));
+    header.codes_offset = section((n + 1) * sizeof(uint64_t));
+    header.positions_offset = section((n + 1) * sizeof(uint32_t));
+    header.file_size = end;
+
+    std::string const tmp = path + ".tmp";
+    std::FILE* const file = std::fopen(tmp.c_str(), "wb");
+    if (file == nullptr)
+        throw std::runtime_error("snapshot: cannot create " + tmp);
+    try
+    {
+        snapshot::Writer out{file};
+        out.write(&header, sizeof(header));
+        out.seek_section(header.keys_offset);
+        out.write(keys.data(), n * sizeof(Point));
+        out.seek_section(header.value_offsets_offset);
+        out.write(value_offsets.data(), (n + 1) * sizeof(uint64_t));
+        out.seek_section(header.values_offset);
+        for (auto it = db.begin(); it != db.end(); ++it)
+            out.write(it.second().begin(), it.second().size() * sizeof(double));
+        out.seek_section(header.codes_offset);
+        out.write(codes.data(), (n + 1) * sizeof(uint64_t));
+        out.seek_section(header.positions_offset);
+        out.write(positions.data(), (n + 1) * sizeof(uint32_t));
+    }
+    catch (...)
+    {
+        std::fclose(file);
+        std::remove(tmp.c_str());
+        throw;
+    }
+    if (std::fclose(file) != 0 || std::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("snapshot: cannot write " + path);
+    }
+}
+
+/// Read-only database served straight from a snapshot file
+/// The file is mapped into memory and used in place, opening it only checks
+/// the header and that the sections fit in the file. Pages are read in as
+/// lookups touch them.
+/// Lookups check the value offsets and positions they read, so a corrupt
+/// file cannot send them outside the mapping; its broken entries read as
+/// missing. validate() checks all of them up front.
+/// Platforms without mmap read the whole file into memory instead.
+class ArenaSnapshot final
+{
+    char* base = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+
+    SnapshotHeader header;
+    Point const* keys = nullptr;
+    uint64_t const* value_offsets = nullptr;
+    double const* value_data = nullptr;
+    uint64_t const* codes = nullptr;
+    uint32_t const* positions = nullptr;
+
+public:
+    /// Throw std::runtime_error if path is not a readable snapshot
+    explicit ArenaSnapshot(std::string const& path)
+    {
+        open(path);
+        try
+        {
+            check_header(path);
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+        keys = section<Point>(header.keys_offset);
+        value_offsets = section<uint64_t>(header.value_offsets_offset);
+        value_data = section<double>(header.values_offset);
+        codes = section<uint64_t>(header.codes_offset);
+        positions = section<uint32_t>(header.positions_offset);
+    }
+
+    ArenaSnapshot(ArenaSnapshot const&) = delete;
+    ArenaSnapshot& operator=(ArenaSnapshot const&) = delete;
+
+    ArenaSnapshot(ArenaSnapshot&& s) noexcept
+        : base(s.base)
+        , length(s.length)
+        , mapped(s.mapped)
+        , header(s.header)
+        , keys(s.keys)
+        , value_offsets(s.value_offsets)
+        , value_data(s.value_data)
+        , codes(s.codes)
+        , positions(s.positions)
+    {
+        s.base = nullptr;
+        s.length = 0;
+    }
+
+    ~ArenaSnapshot()
+    {
+        release();
+    }
+
+    /// Number of keys
+    size_t size() const noexcept
+    {
+        return size_t(header.key_count);
+    }
+
+    KeyOrder key_order() const noexcept
+    {
+        return KeyOrder(header.key_order);
+    }
+
+    /// i-th key in key order
+    Point key(size_t const i) const noexcept
+    {
+        return keys[i];
+    }
+
+    /// Values of the i-th key in key order
+    /// An empty span that converts to false if the offsets of i are corrupt
+    ValueSpan values(size_t const i) const noexcept
+    {
+        uint64_t const first = value_offsets[i];
+        uint64_t const last = value_offsets[i + 1];
+        if (first > last || last > header.value_count)
+            return ValueSpan{};
+        return ValueSpan{value_data + first, value_data + last};
+    }
+
+    /// Values of p, an empty span that converts to false if p is missing
+    ValueSpan get(Point const p) const noexcept
+    {
+        uint64_t const code =
+            key_order() == KeyOrder::Morton ? morton::encode(p) : lexicographic_code(p);
+        uint32_t const pos = eytzinger::find(codes, positions, size(), code);
+        if (pos >= size())
+            return ValueSpan{};
+        return values(pos);
+    }
+
+    /// Call f(Point, ValueSpan) for every key in key order
+    template <typename F>
+    void for_each(F&& f) const
+    {
+        for (size_t i = 0; i < size(); ++i)
+            f(keys[i], values(i));
+    }
+
+    /// Check every value offset and position, throw std::runtime_error if
+    /// one is corrupt
+    /// Reads the offsets and positions sections once, opening does not
+    void validate() const
+    {
+        if (!indices_valid())
+            throw std::runtime_error("snapshot: corrupt value offsets or positions");
+    }
+
+private:
+    template <typename T>
+    T const* section(uint64_t const offset) const noexcept
+    {
+        return reinterpret_cast<T const*>(base + offset);
+    }
+
+    void open(std::string const& path)
+    {
+#if ARENA_HAS_MMAP
+        int const fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("snapshot: cannot open " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("snapshot: cannot stat " + path);
+        }
+        length = size_t(st.st_size);
+        if (length != 0)
+        {
+            void* const p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED)
+                throw std::runtime_error("snapshot: cannot map " + path);
+            base = (char*)p;
+            mapped = true;
+        }
+        else
+        {
+            ::close(fd);
+        }
+#else
+        std::FILE* const file = std::fopen(path.c_str(), "rb");
+        if (file == nullptr)
+            throw std::runtime_error("snapshot: cannot open " + path);
+        std::fseek(file, 0, SEEK_END);
+        long const end = std::ftell(file);
+        std::fseek(file, 0, SEEK_SET);
+        length = end < 0 ? 0 : size_t(end);
+        base = new char[length == 0 ? 1 : length];
+        size_t const read = std::fread(base, 1, length, file);
+        std::fclose(file);
+        if (read != length)
+        {
+            release();
+            throw std::runtime_error("snapshot: cannot read " + path);
+        }
+#endif
+    }
+
+    void check_header(std::string const& path)
+    {
+        if (length < sizeof(SnapshotHeader))
+            throw std::runtime_error("snapshot: " + path + " is too short");
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+            throw std::runtime_error("snapshot: " + path + " is not a snapshot");
+        if (header.version != SNAPSHOT_VERSION || header.byte_order != SNAPSHOT_BYTE_ORDER)
+            throw std::runtime_error("snapshot: " + path + " has an unsupported version");
+        if (header.file_size != length ||
+            header.key_order > uint32_t(KeyOrder::Morton) ||
+            !fits(header.keys_offset, header.key_count, sizeof(Point)) ||
+            !fits(header.value_offsets_offset, header.key_count + 1, sizeof(uint64_t)) ||
+            !fits(header.values_offset, header.value_count, sizeof(double)) ||
+            !fits(header.codes_offset, header.key_count + 1, sizeof(uint64_t)) ||
+            !fits(header.positions_offset, header.key_count + 1, sizeof(uint32_t)))
+            throw std::runtime_error("snapshot: " + path + " is truncated or corrupt");
+    }
+
+    /// Whether the value offsets run from 0 to value_count without going back
+    /// and every code points at a key
+    bool indices_valid() const noexcept
+    {
+        if (value_offsets[0] != 0 || value_offsets[size()] != header.value_count)
+            return false;
+        for (size_t i = 0; i < size(); ++i)
+        {
+            if (value_offsets[i] > value_offsets[i + 1])
+                return false;
+        }
+        // slot 0 is unused
+        for (size_t i = 1; i <= size(); ++i)
+        {
+            if (positions[i] >= header.key_count)
+                return false;
+        }
+        return true;
+    }
+
+    /// Whether count items of size bytes at offset lie inside the file
+    bool fits(uint64_t const offset, uint64_t const count, size_t const size) const noexcept
+    {
+        if (offset % CACHE_LINE_SIZE != 0 || offset > length)
+            return false;
+        return count <= (length - offset) / size;
+    }
+
+    void release() noexcept
+    {
+        if (base == nullptr)
+            return;
+#if ARENA_HAS_MMAP
+        if (mapped)
+            munmap(base, length);
+        else
+            delete[] base;
+#else
+        delete[] base;
+#endif
+        base = nullptr;
+        length = 0;
+    }
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include "arena.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+/// Set of erased rows, one bit per row
+/// Rows past the covered range are live, so a table nothing was erased from
+/// pays a single compare per check.
+/// !!Important!! this object does not manage memory.
+/// Words are taken from the ArenaAllocator passed to insert, growing leaves
+/// the old ones in the arena until it is cleared.
+class Tombstones final
+{
+    uint64_t* words = nullptr;
+    // rows covered by the words, a multiple of 64
+    size_t covered = 0;
+    size_t count = 0;
+
+public:
+    /// Number of erased rows
+    size_t size() const noexcept
+    {
+        return count;
+    }
+
+    bool contains(size_t const row) const noexcept
+    {
+        return row < covered && (words[row / 64] >> (row % 64) & 1) != 0;
+    }
+
+    /// Mark row as erased, rows is the number of rows of the table
+    /// Returns false if it was erased already
+    bool insert(ArenaAllocator& allocator, size_t const row, size_t const rows)
+    {
+        assert(row < rows);
+        if (row >= covered)
+            grow(allocator, std::max(rows, 2 * covered));
+        uint64_t const bit = uint64_t(1) << (row % 64);
+        uint64_t& word = words[row / 64];
+        if ((word & bit) != 0)
+            return false;
+        word |= bit;
+        ++count;
+        return true;
+    }
+
+    /// Forget all tombstones but keep the words
+    void clear() noexcept
+    {
+        std::fill(words, words + covered / 64, uint64_t(0));
+        count = 0;
+    }
+
+private:
+    void grow(ArenaAllocator& allocator, size_t const rows)
+    {
+        size_t const n = (rows + 63) / 64;
+        uint64_t* const grown = allocator.allocate<uint64_t>(n);
+        std::copy(words, words + covered / 64, grown);
+        std::fill(grown + covered / 64, grown + n, uint64_t(0));
+        words = grown;
+        covered = n * 64;
+    }
+};